@@ -10,23 +10,526 @@
 #include <algorithm> 
 #include <sstream>   
 #include <iomanip>   
+#include <string_view>
+#include <charconv>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <optional>
+#include <limits>
+#include <queue>
+#include <deque>
+#include <set>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <memory_resource>
+#include <numeric>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+// --- Allocation Accounting ---
+// Global operator new is replaced to count heap allocations, so stats can show
+// how many allocations each formed party costs.
+std::atomic<unsigned long long> heap_allocations(0);
+
+// GCC pairs the builtin new with these free() calls when inlining and warns.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(std::size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+enum Role { ROLE_TANK, ROLE_HEALER, ROLE_DPS, ROLE_COUNT };
+constexpr int ROLE_MASKS = 1 << ROLE_COUNT;  // role bitmasks: bit r set = can play role r
+
+// Players a cross-region party took from one donor region's queue for a role.
+struct PlayerLoan {
+    int region;
+    int role;
+    long long count;
+};
+
+// Where a formed party's members came from beyond its own single-role
+// queues, so a failed ready check can send each back to the queue they left.
+struct PartySources {
+    long long flex[ROLE_MASKS][ROLE_COUNT] = {};  // flex players by bucket and the role they took
+    std::vector<PlayerLoan> loans;                // oldest first; empty unless cross-region
+};
+
+// --- Party Records ---
+// Everything about one run in flight. Records come from a SlabPool: fixed-size
+// chunks that are never freed, with released records reused, so steady-state
+// formation needs no heap allocation for them.
+struct PartyRecord {
+    int region = 0;
+    int instance_id = 0;
+    int extra_seconds = 0;  // cross-region penalty
+    int duration = 0;       // drawn when the run begins
+    std::chrono::steady_clock::time_point started;
+    // With ready checks: the members who go back if the check fails, by the
+    // queue they came from (the rest return to their own role queues). The
+    // loan list keeps its capacity when the record is reused.
+    PartySources returning;
+};
+
+template <typename T, size_t ChunkSize = 256>
+class SlabPool {
+    std::vector<std::unique_ptr<T[]>> chunks_;
+    std::vector<T*> free_;  // capacity always covers every slot, so release never allocates
+    size_t in_use_ = 0;
+    size_t high_water_ = 0;
+public:
+    T* acquire() {
+        if (free_.empty()) {
+            chunks_.push_back(std::make_unique<T[]>(ChunkSize));
+            free_.reserve(chunks_.size() * ChunkSize);
+            for (size_t i = ChunkSize; i-- > 0;) free_.push_back(&chunks_.back()[i]);
+        }
+        T* item = free_.back();
+        free_.pop_back();
+        *item = T{};
+        high_water_ = std::max(high_water_, ++in_use_);
+        return item;
+    }
+    void release(T* item) {
+        free_.push_back(item);
+        in_use_--;
+    }
+    size_t chunks() const { return chunks_.size(); }
+    size_t in_use() const { return in_use_; }
+    size_t high_water() const { return high_water_; }
+};
+
+// Scratch memory for one pass of a loop (an epoch): a bump allocator over a
+// fixed buffer, released wholesale when the pass ends. Only a pass that
+// outgrows the buffer touches the heap.
+template <size_t Size>
+class EpochArena {
+    alignas(std::max_align_t) char buffer_[Size];
+    std::pmr::monotonic_buffer_resource resource_{buffer_, sizeof(buffer_), std::pmr::new_delete_resource()};
+public:
+    std::pmr::memory_resource* resource() { return &resource_; }
+    void reset() { resource_.release(); }
+};
 
 struct DungeonInstance {
     int id;
     std::string status;
     int parties_served;
     long long total_time_served;
-    DungeonInstance(int i) : id(i), status("empty"), parties_served(0), total_time_served(0) {}
+    bool pooled;  // currently held by the instance selector
+    PartyRecord* party = nullptr;  // the run in progress, if any
+    // Busy intervals as varint (idle gap, busy length) pairs in milliseconds,
+    // each gap measured from the previous interval's end; kept with --timeline.
+    std::vector<unsigned char> timeline;
+    long long timeline_end_ms = 0;
+    long long timeline_intervals = 0;
+    DungeonInstance(int i) : id(i), status("empty"), parties_served(0), total_time_served(0), pooled(false) {}
+};
+
+// --- Parameter Limits ---
+constexpr int max_instances = 1000000;
+constexpr int max_run_seconds = 86400;
+constexpr int max_party_role_size = 1000;
+constexpr long long max_queue_size = std::numeric_limits<long long>::max();
+
+enum class DurationDistribution { Uniform, Exponential, Normal };
+enum class LogLevel { Quiet, Normal, Verbose };
+enum class RunScheduler { Thread, Timer, Process };
+enum class InstancePolicy { FirstFree, RoundRobin, LeastRecentlyUsed, LeastTotalTime, Random };
+enum class SchedulingPolicy { Default, Other, Fifo, RoundRobin };
+enum class AdmissionPolicy { DropNewest, DropOldest, Delay };
+
+// Affinity and scheduling for one class of threads. Formers take one CPU each
+// (cpus[region % size]); worker threads may run on any CPU in the set.
+struct ThreadPlacement {
+    std::vector<int> cpus;  // empty: leave affinity alone (or to --numa)
+    SchedulingPolicy policy = SchedulingPolicy::Default;
+    int priority = 0;       // real-time priority for fifo/rr, nice value for other
+};
+
+// --- Arrival Profiles ---
+// A piecewise-linear arrival rate over one period (a day, say), repeated.
+// Points are "time:rate"; two points at one time make a step, so a spike is
+// "12h:0.1,12h:2,13h:2,13h:0.1". A single point is a constant rate.
+struct RateProfile {
+    std::vector<std::pair<double, double>> points;  // (seconds into the period, players/second)
+    bool empty() const { return points.empty(); }
+    double period() const { return points.back().first; }
+};
+
+// --- Startup Configuration ---
+// Defaults, overridden by --config <file.ini>, then by CLI flags. Values left
+// unset after both are prompted for interactively, as before.
+struct SimulationConfig {
+    std::optional<int> instances;
+    std::optional<long long> queue[ROLE_COUNT];
+    std::optional<int> min_time;
+    std::optional<int> max_time;
+    std::optional<unsigned long long> seed;
+    int party[ROLE_COUNT] = {1, 1, 3};
+    DurationDistribution distribution = DurationDistribution::Uniform;
+    LogLevel log_level = LogLevel::Verbose;
+    RunScheduler scheduler = RunScheduler::Thread;
+    int workers = 2;  // worker processes for scheduler=process
+    InstancePolicy instance_policy = InstancePolicy::FirstFree;
+    long long queue_capacity[ROLE_COUNT] = {0, 0, 0};  // per region and role; 0 = unbounded
+    AdmissionPolicy admission_policy = AdmissionPolicy::DropNewest;
+    std::string control_socket;
+    std::string shm_name;      // publish state to this POSIX shared-memory segment
+    int shm_capacity = 0;      // instance status slots per region; 0 = max(initial instances, 1024)
+    std::string shm_dump;      // print a segment published by another process and exit
+    double arrival_rate[ROLE_COUNT] = {0, 0, 0};  // players per second
+    double flex_rate = 0;                         // flex players per second (for --flex-compare)
+    RateProfile arrival_profile[ROLE_COUNT];      // time-varying rates; override arrival_rate
+    double profile_time_scale = 1;                // profile seconds per real second in the live simulation
+    double profile_bucket = 3600;                 // --profile-report row width, in seconds
+    bool profile_report = false;
+    int flex_roles = (1 << ROLE_COUNT) - 1;       // roles a flex player accepts
+    ThreadPlacement former_placement;  // party formers
+    ThreadPlacement worker_placement;  // dungeon runs, timer scheduler, worker link
+    std::string event_log;               // write the event journal here
+    int event_checkpoint_every = 10000;  // journal a checkpoint every n events; 0 = never
+    std::string replay;                  // fold a journal, print the derived state and exit
+    std::optional<double> replay_until;  // only events up to this many seconds
+    int summary_instances = -1;          // per-instance summary lines: -1 auto, 0 none, k = busiest/least used k
+    std::string timeline;                // write an instance utilization heatmap here (.pgm image, else CSV)
+    int timeline_buckets = 60;           // heatmap columns across the run
+    bool numa = false;            // home each region's former, runs and instances on a NUMA node
+    bool numa_benchmark = false;
+    bool show_help = false;       // --help: print usage and exit successfully
+    bool analyze = false;
+    double cross_check_seconds = 0;
+    bool find_min_instances = false;
+    double p99_target = 0;
+    double search_horizon = 86400;
+    int search_threads = 0;  // 0 = hardware concurrency
+    int replications = 0;    // > 0 runs the Monte Carlo mode
+    bool flex_compare = false;
+    double confidence = 0.95;
+    std::optional<int> compare_instances;
+    struct RegionConfig {
+        std::string name;
+        std::optional<int> instances;
+        std::optional<long long> queue[ROLE_COUNT];
+    };
+    std::vector<RegionConfig> regions;  // empty: one unnamed region from instances/queue
+    double overflow_after = 0;          // seconds; 0 disables cross-region parties
+    int cross_region_penalty = 0;       // extra run seconds for a cross-region party
+    double batch_window = 0;            // seconds a formable party may wait for a batch; 0 = immediate
+    int batch_max_parties = 0;          // close the window early at this many parties; 0 = free instances
+    int staging_capacity = 0;           // formed parties staged per region for a dispatcher; 0 = no staging
+    double ready_check_timeout = 0;     // seconds to accept a ready check; 0 = no ready check
+    double ready_check_decline = 0;     // probability that a member declines
+    double ready_check_response = 2;    // mean seconds a member takes to answer
+    bool closed_population = false;     // players re-queue after a cooldown instead of leaving
+    double population_cooldown = 30;
+    double population_warmup = 0;
 };
 
-int tank_queue;
-int healer_queue;
-int dps_queue;
 int min_time;
 int max_time;
+int party_template[ROLE_COUNT] = {1, 1, 3};
+DurationDistribution duration_distribution = DurationDistribution::Uniform;
+LogLevel log_level = LogLevel::Verbose;
+RunScheduler run_scheduler = RunScheduler::Thread;
+
+std::atomic<int> active_parties(0);  // across all regions
+std::atomic<int> staged_parties(0);  // formed, waiting in a staging queue for an instance
+
+// --- Instance Selection (guarded by g_mutex) ---
+// Holds the free instances and picks which one the next party gets. After a
+// scale-down, ids at or beyond instance_limit may linger inside a selector;
+// acquire_free_instance() discards them lazily.
+class InstanceSelector {
+public:
+    virtual ~InstanceSelector() = default;
+    virtual void release(int id) = 0;
+    virtual int acquire() = 0;  // -1 when empty
+};
+
+// Lowest free index, as the original linear scan did. O(log n) min-heap.
+class FirstFreeSelector : public InstanceSelector {
+    std::priority_queue<int, std::vector<int>, std::greater<int>> free_;
+public:
+    void release(int id) override { free_.push(id); }
+    int acquire() override {
+        if (free_.empty()) return -1;
+        int id = free_.top();
+        free_.pop();
+        return id;
+    }
+};
 
-std::vector<DungeonInstance> instances;
-std::atomic<int> active_parties(0);
+// Next free index after the last one assigned, wrapping. O(log n) ordered set.
+class RoundRobinSelector : public InstanceSelector {
+    std::set<int> free_;
+    int cursor_ = 0;
+public:
+    void release(int id) override { free_.insert(id); }
+    int acquire() override {
+        if (free_.empty()) return -1;
+        auto it = free_.lower_bound(cursor_);
+        if (it == free_.end()) it = free_.begin();
+        int id = *it;
+        free_.erase(it);
+        cursor_ = id + 1;
+        return id;
+    }
+};
+
+// The instance that has been free the longest. O(1) FIFO.
+class LeastRecentlyUsedSelector : public InstanceSelector {
+    std::deque<int> free_;
+public:
+    void release(int id) override { free_.push_back(id); }
+    int acquire() override {
+        if (free_.empty()) return -1;
+        int id = free_.front();
+        free_.pop_front();
+        return id;
+    }
+};
+
+// The instance with the least accumulated run time. An instance's total only
+// changes while it is busy, so the key is fixed while it sits in the heap.
+class LeastTotalTimeSelector : public InstanceSelector {
+    using Entry = std::pair<long long, int>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> free_;
+    const std::vector<DungeonInstance>& instances_;
+public:
+    explicit LeastTotalTimeSelector(const std::vector<DungeonInstance>& all) : instances_(all) {}
+    void release(int id) override { free_.push({instances_[id].total_time_served, id}); }
+    int acquire() override {
+        if (free_.empty()) return -1;
+        int id = free_.top().second;
+        free_.pop();
+        return id;
+    }
+};
+
+// Uniformly random free instance. O(1) swap-and-pop.
+class RandomSelector : public InstanceSelector {
+    std::vector<int> free_;
+    std::mt19937_64 gen_;
+public:
+    explicit RandomSelector(unsigned long long seed) : gen_(seed) {}
+    void release(int id) override { free_.push_back(id); }
+    int acquire() override {
+        if (free_.empty()) return -1;
+        size_t index = std::uniform_int_distribution<size_t>(0, free_.size() - 1)(gen_);
+        int id = free_[index];
+        free_[index] = free_.back();
+        free_.pop_back();
+        return id;
+    }
+};
+
+InstancePolicy instance_policy = InstancePolicy::FirstFree;
+
+// --- Regions (guarded by g_mutex) ---
+// Each region has its own role queues, instance pool and former thread.
+// Without [region.*] config there is a single unnamed region, which behaves
+// and logs exactly like the original flat pool.
+struct QueuedBatch {
+    std::chrono::steady_clock::time_point since;
+    long long count;
+    long long first;  // arrival index of the batch's first player; keys the player's rating
+};
+
+// A party the matcher formed before any instance was free. The dispatcher
+// gives it the next free instance; its players have already left the queues.
+struct StagedParty {
+    long long borrowed[ROLE_COUNT] = {0, 0, 0};  // from other regions
+    PartySources sources;
+    bool cross_region = false;
+    std::chrono::steady_clock::time_point staged_at;
+};
+
+struct Region {
+    std::string name;
+    long long queue[ROLE_COUNT] = {0, 0, 0};
+    std::deque<QueuedBatch> waiting[ROLE_COUNT];  // arrival order; counts sum to queue[role]
+    long long arrivals[ROLE_COUNT] = {0, 0, 0};    // next arrival index per role
+    // Flex players, bucketed by role bitmask (masks naming two or more roles).
+    long long flex[ROLE_MASKS] = {};
+    std::deque<QueuedBatch> flex_waiting[ROLE_MASKS];
+    long long flex_matched[ROLE_COUNT] = {0, 0, 0};  // flex players by the role they were given
+    long long flex_parties = 0;                       // parties that needed a flex player
+    std::vector<DungeonInstance> instances;
+    std::unique_ptr<InstanceSelector> selector;
+    int instance_limit = 0;       // instances at or beyond this index are retired once free
+    int free_instance_count = 0;  // free instances below instance_limit
+    int node = -1;                // NUMA node the region is homed on, -1 when placement is off
+    const DungeonInstance* homed_instances = nullptr;  // instances.data() when last first-touched on node
+    int active_parties = 0;
+    long long parties_formed = 0;
+    long long cross_region_parties = 0;  // formed here with players borrowed from other regions
+    long long parties_served = 0;
+    long long total_time_served = 0;
+    long long players_matched = 0;  // players of this region's queue, wherever they played
+    double total_wait_seconds = 0;
+    // Backpressure, when queue_capacity is set.
+    long long rejected[ROLE_COUNT] = {0, 0, 0};  // drop-newest: turned away on arrival
+    long long evicted[ROLE_COUNT] = {0, 0, 0};   // drop-oldest: pushed out by newer players
+    long long backlog[ROLE_COUNT] = {0, 0, 0};   // delay: held outside the queue
+    std::deque<QueuedBatch> backlog_waiting[ROLE_COUNT];
+    long long players_delayed = 0;       // held at least once on arrival
+    long long admitted_from_backlog = 0;
+    double total_admission_delay = 0;    // seconds spent in the backlog
+    // Adaptive batching: when the current window opened, and what batching cost and bought.
+    std::optional<std::chrono::steady_clock::time_point> batch_opened;
+    long long batches = 0;
+    long long batched_parties = 0;
+    double total_formation_delay = 0;  // seconds a formable party waited for its window
+    double max_formation_delay = 0;
+    double total_rating_spread = 0;    // max - min member rating, summed over batched parties
+    // Instances ordered by (parties served, id) and (run time, id), updated on
+    // every completion so the summary's min/max and listings need no scan.
+    std::set<std::pair<long long, int>> by_parties;
+    std::set<std::pair<long long, int>> by_time;
+    // Free instance-seconds by cause, and time a formable party had no instance,
+    // accumulated up to accounted_until at every queue or instance change.
+    std::chrono::steady_clock::time_point accounted_until;
+    double idle_starved_seconds = 0;   // players waiting, but some role short
+    double idle_empty_seconds = 0;     // nobody waiting
+    double idle_held_seconds = 0;      // a party was formable: batching window or pause
+    double capacity_limited_seconds = 0;
+    // Two-stage pipeline (staging_capacity > 0): a ring of formed parties
+    // sized once at startup, filled by the former and drained by the dispatcher.
+    std::vector<StagedParty> staged;
+    size_t staged_head = 0;
+    size_t staged_count = 0;
+    size_t staged_peak = 0;
+    long long parties_dispatched = 0;  // parties that left the staging queue
+    double total_dispatch_wait = 0;    // seconds staged parties waited for an instance
+    double max_dispatch_wait = 0;
+    long long stage_full_stalls = 0;   // former passes that ended with a formable party and a full stage
+    // Ready checks, when ready_check_timeout is set.
+    long long ready_checks = 0;
+    long long ready_checks_declined = 0;  // failed on a decline
+    long long ready_checks_timed_out = 0; // failed on a member who never answered
+    long long players_returned = 0;       // re-queued at the front after a failed check
+    long long players_dropped = 0;        // declined or timed out, and left
+    double ready_check_seconds = 0;       // instance-seconds held by checks
+    double failed_check_seconds = 0;      // of which by checks that failed
+};
+
+// Sized once at startup: selectors hold references to their region's instances.
+std::vector<Region> regions;
+std::vector<std::vector<int>> numa_nodes;  // CPUs per node; empty when placement is off
+long long queue_capacity[ROLE_COUNT] = {0, 0, 0};
+AdmissionPolicy admission_policy = AdmissionPolicy::DropNewest;
+ThreadPlacement former_placement;
+ThreadPlacement worker_placement;
+SlabPool<PartyRecord> party_records;  // guarded by g_mutex
+
+// Time from the last state change that may give a former work to the former
+// running again after sleeping: what pinning and priority are meant to keep low.
+std::atomic<long long> wake_requested_ns(0);  // since start_time
+long long former_wakeups = 0;                 // guarded by g_mutex
+double former_wake_latency_total = 0;
+double former_wake_latency_max = 0;
+int summary_instances = -1;
+std::string timeline_path;  // empty: no busy intervals are kept
+int timeline_buckets = 60;
+double overflow_after = 0;
+double batch_window = 0;
+int batch_max_parties = 0;
+unsigned long long rating_seed = 0;
+int cross_region_penalty = 0;
+int staging_capacity = 0;  // formed parties a region may stage; 0 = form only into a free instance
+
+// --- Event Stream ---
+// Every change to queue and instance state is also appended to event_buffer
+// (under g_mutex). The EventJournal thread drains it off-lock, folds it into a
+// derived copy of the state and, with events.log set, writes a journal that
+// --replay folds back into the same state, from its last checkpoint.
+enum class EventType : char {
+    PlayerQueued = 'Q',
+    PlayerEvicted = 'E',    // drop-oldest backpressure
+    PlayersBorrowed = 'B',  // taken from this region's queue by a cross-region party
+    PartyFormed = 'F',      // value is the instance, or -1 when the party was staged
+    PartyDispatched = 'D',  // a staged party got its instance
+    ReadyCheckFailed = 'R', // frees the instance; amounts are the players re-queued at the front
+    RunCompleted = 'C',
+    InstancesScaled = 'S',
+    FlexQueued = 'X',       // value is the role mask, amounts[0] the players
+    FlexMatched = 'M',      // value is the role mask, amounts the roles they were given
+};
+
+struct SimEvent {
+    EventType type;
+    int region;
+    int value;  // instance id, or the new limit for InstancesScaled
+    int duration;
+    long long amounts[ROLE_COUNT];
+    double at;  // seconds since start
+    unsigned long long seq;
+};
+
+struct EventState {
+    struct RegionState {
+        long long queue[ROLE_COUNT] = {0, 0, 0};
+        int instance_limit = 0;
+        std::vector<char> active;  // per instance id
+        long long active_parties = 0;
+        long long parties_formed = 0;
+        long long parties_served = 0;
+        long long total_time_served = 0;
+        long long staged = 0;  // formed, not yet dispatched
+        long long flex[ROLE_MASKS] = {};
+    };
+    std::vector<RegionState> regions;
+    unsigned long long seq = 0;
+};
+
+std::vector<SimEvent> event_buffer;  // guarded by g_mutex
+unsigned long long event_seq = 0;    // guarded by g_mutex
+EventState event_state;              // owned by the EventJournal thread until it exits
+std::atomic<unsigned long long> events_folded(0);
+std::FILE* event_journal_file = nullptr;
+int event_checkpoint_every = 10000;
+std::mutex journal_mutex;
+std::condition_variable journal_cv;
+bool journal_stopping = false;
+
+// --- Operator Controls and Running Totals (guarded by g_mutex) ---
+bool formation_paused = false;
+bool admission_closed = false;  // set by drain; adds are rejected until resume
+long long players_rejected = 0;
+unsigned long long applied_control_seq = 0;
+
+std::mt19937 rng(std::random_device{}());
 
 // --- Synchronization Primitives ---
 std::mutex g_mutex;
@@ -37,6 +540,177 @@ std::mutex cout_mutex;
 // --- Time, Logging, and Shutdown Signal ---
 std::chrono::steady_clock::time_point start_time;
 std::atomic<bool> simulation_running(true);
+std::mutex shutdown_mutex;
+std::condition_variable shutdown_cv;
+
+// --- Timer Scheduler ---
+// With scheduler=timer, runs are completed by one thread sleeping until the
+// earliest deadline instead of one detached thread per run.
+struct ScheduledRun {
+    std::chrono::steady_clock::time_point finish;
+    PartyRecord* party;
+    bool operator>(const ScheduledRun& other) const { return finish > other.finish; }
+};
+
+std::mutex timer_mutex;
+std::condition_variable timer_cv;
+std::priority_queue<ScheduledRun, std::vector<ScheduledRun>, std::greater<ScheduledRun>> timer_queue;
+bool timer_stopping = false;
+
+// --- Ready Checks ---
+// With ready_check_timeout set, a party holds its instance while every member
+// answers a ready check. Responses are drawn when the instance is reserved;
+// one thread sleeps until each check resolves, like the timer scheduler.
+struct PendingReadyCheck {
+    std::chrono::steady_clock::time_point resolves;
+    std::chrono::steady_clock::time_point reserved;
+    PartyRecord* party;
+    bool ready;                      // every member accepted in time
+    bool timed_out;                  // failed because someone never answered
+    long long returned[ROLE_COUNT];  // members sent back to the front of the queue
+    bool operator>(const PendingReadyCheck& other) const { return resolves > other.resolves; }
+};
+
+double ready_check_timeout = 0;   // seconds to accept; 0 = no ready check
+double ready_check_decline = 0;   // probability that a member declines
+double ready_check_response = 2;  // mean seconds a member takes to answer
+std::mt19937_64 ready_check_rng;  // guarded by g_mutex
+std::mutex ready_check_mutex;
+std::condition_variable ready_check_cv;
+std::priority_queue<PendingReadyCheck, std::vector<PendingReadyCheck>, std::greater<PendingReadyCheck>> ready_check_queue;
+bool ready_check_stopping = false;
+
+// --- Closed Population ---
+// With closed_population, players who finish a run (or leave a failed ready
+// check) re-queue after population_cooldown instead of going offline. Each
+// finished party's players wait in a pooled record until they return.
+struct ReturningParty {
+    int region = 0;
+    long long players[ROLE_COUNT] = {0, 0, 0};
+};
+
+struct ScheduledReturn {
+    std::chrono::steady_clock::time_point at;
+    ReturningParty* party;
+    bool operator>(const ScheduledReturn& other) const { return at > other.at; }
+};
+
+// Counters at the end of the warm-up, so steady-state rates exclude the start.
+struct PopulationBaseline {
+    bool taken = false;
+    double at = 0;  // seconds since start
+    long long parties_served = 0;
+    long long players_matched = 0;
+    double total_wait_seconds = 0;
+};
+
+bool closed_population = false;
+double population_cooldown = 0;  // seconds between finishing and re-queueing
+double population_warmup = 0;    // seconds before the steady-state baseline
+SlabPool<ReturningParty> returning_parties;  // guarded by g_mutex, like the queue below
+std::priority_queue<ScheduledReturn, std::vector<ScheduledReturn>, std::greater<ScheduledReturn>> return_queue;
+long long players_cooling_down = 0;
+long long population_returns = 0;  // players re-queued after a cooldown
+PopulationBaseline population_baseline;
+
+// --- Live Arrivals ---
+// With a rate profile, the arrival generator admits players on the curve;
+// profile time runs profile_time_scale times faster than the wall clock.
+RateProfile arrival_profiles[ROLE_COUNT];
+double profile_time_scale = 1;
+unsigned long long arrival_seed = 0;
+
+bool profiled_arrivals() {
+    for (const auto& profile : arrival_profiles) {
+        if (!profile.empty()) return true;
+    }
+    return false;
+}
+
+// Runs that keep admitting players on their own have no idle point to wait for.
+bool open_ended_run() { return closed_population || profiled_arrivals(); }
+
+// --- Worker Processes ---
+// With scheduler=process, runs are timed by forked worker processes; worker
+// w owns instances whose id % workers == w in every region. Assignments and
+// completions are text lines on a socketpair, batched per former pass and
+// per worker wakeup. The coordinator keeps the queues and free-instance view.
+struct WorkerLink {
+    int fd = -1;
+    int pid = -1;
+    std::string outbox;  // assignments not yet sent, guarded by g_mutex
+    std::mutex write_mutex;
+    std::string report;  // the worker's own totals, sent when it exits
+};
+
+struct CoordinationStats {
+    long long assignments = 0;
+    long long assignment_batches = 0;
+    long long completions = 0;
+    long long completion_batches = 0;
+    long long bytes = 0;
+    double overhead_seconds = 0;  // time from formation to completion beyond the run itself
+    double max_overhead_seconds = 0;
+};
+
+std::vector<std::unique_ptr<WorkerLink>> workers;
+CoordinationStats coordination;  // guarded by g_mutex
+
+// --- Shared-Memory State ---
+// With --shm-name, publish_snapshot() also writes the counters and instance
+// statuses into a POSIX shared-memory segment. All writers hold g_mutex, so a
+// single-writer seqlock suffices: readers load the sequence (retry while odd),
+// copy, then retry if the sequence moved. Every field is a lock-free atomic
+// so the layout is plain 64-bit integers to readers in any language.
+constexpr uint32_t shm_magic = 0x5347464c;  // "LFGS"
+constexpr uint32_t shm_layout_version = 1;
+// A reader gives up after this many tries (about a second with the backoff):
+// a sequence that stays odd or keeps moving means the writer died mid-update.
+constexpr int shm_max_read_attempts = 1000;
+
+struct SharedCounters {
+    std::atomic<int64_t> queue[ROLE_COUNT];
+    std::atomic<int64_t> active_parties;
+    std::atomic<int64_t> instance_limit;
+    std::atomic<int64_t> free_instances;
+    std::atomic<int64_t> parties_formed;
+    std::atomic<int64_t> parties_served;
+    std::atomic<int64_t> total_time_served;
+};
+
+struct SharedRegion {
+    char name[32];  // written once at creation
+    SharedCounters counters;
+};
+
+// Followed by SharedRegion[region_count], then one status byte per instance
+// slot per region (0 empty, 1 active), region-major.
+struct SharedStateHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t region_count;
+    uint32_t instance_capacity;
+    std::atomic<uint64_t> sequence;
+    std::atomic<int64_t> uptime_ms;
+    std::atomic<int64_t> players_rejected;
+    std::atomic<int64_t> flags;  // bit 0 paused, bit 1 draining, bit 2 idle
+    std::atomic<int64_t> applied_seq;
+    SharedCounters totals;
+};
+
+static_assert(std::atomic<int64_t>::is_always_lock_free, "shared counters must be lock-free");
+
+SharedStateHeader* shared_state = nullptr;
+size_t shared_state_size = 0;
+std::string shared_state_name;
+std::vector<std::pair<int, int>> shared_status_dirty;  // (region, instance), guarded by g_mutex
+
+// --- Control Socket ---
+std::string control_socket_path;  // empty when the socket interface is disabled
+// Created in main before any thread starts and written once by
+// request_shutdown(); the control server and the input thread poll its read
+// end, which stays readable, to wake from a blocking wait.
+int shutdown_pipe[2] = {-1, -1};
 
 // Thread-safe logging function
 void log_message(const std::string& thread_name, const std::string& message) {
@@ -49,40 +723,434 @@ void log_message(const std::string& thread_name, const std::string& message) {
               << message << std::endl;
 }
 
+// --- Command Parsing ---
+enum class CommandType {
+    None, Add, AddFlex, Quit, Status, Stats, Scale, Pause, Resume, Drain, Seed, SetDuration, Invalid, Unknown
+};
+
+struct Command {
+    CommandType type = CommandType::None;
+    int role = -1;                 // add: role; add (flex): role bitmask
+    long long amount = 0;          // add: players, scale: instance count
+    int region = 0;                // add/scale: index into regions
+    int duration_min = 0;
+    int duration_max = 0;
+    unsigned long long seed = 0;
+    std::string_view word;         // command word as typed (or role, for add)
+    const char* error = nullptr;   // set when type == Invalid
+};
+
+// --- Published Snapshot ---
+// A copy of the simulation state taken by whichever thread just changed it
+// (while it holds g_mutex). status/stats and idle waits read this copy, so the
+// input side never contends on g_mutex with the former or dungeon threads.
+struct RegionSnapshot {
+    std::string name;
+    long long queue[ROLE_COUNT] = {0, 0, 0};
+    int active_parties = 0;
+    int instance_limit = 0;
+    int free_instances = 0;
+    long long parties_formed = 0;
+    long long cross_region_parties = 0;
+    long long parties_served = 0;
+    long long total_time_served = 0;
+    long long players_matched = 0;
+    double total_wait_seconds = 0;
+    long long rejected[ROLE_COUNT] = {0, 0, 0};
+    long long evicted[ROLE_COUNT] = {0, 0, 0};
+    long long backlog[ROLE_COUNT] = {0, 0, 0};
+    long long players_delayed = 0;
+    long long admitted_from_backlog = 0;
+    double total_admission_delay = 0;
+    long long batches = 0;
+    long long batched_parties = 0;
+    double total_formation_delay = 0;
+    double max_formation_delay = 0;
+    double total_rating_spread = 0;
+    long long flex_queued = 0;
+    long long flex_matched[ROLE_COUNT] = {0, 0, 0};
+    long long flex_parties = 0;
+    long long staged = 0;
+    long long staged_peak = 0;
+    long long parties_dispatched = 0;
+    double total_dispatch_wait = 0;
+    double max_dispatch_wait = 0;
+    long long stage_full_stalls = 0;
+    long long ready_checks = 0;
+    long long ready_checks_declined = 0;
+    long long ready_checks_timed_out = 0;
+    long long players_returned = 0;
+    long long players_dropped = 0;
+    double ready_check_seconds = 0;
+    double failed_check_seconds = 0;
+};
+
+struct SimulationSnapshot {
+    long long tanks = 0;
+    long long healers = 0;
+    long long dps = 0;
+    int active_parties = 0;
+    int instance_limit = 0;
+    int free_instances = 0;
+    int min_time = 0;
+    int max_time = 0;
+    long long parties_formed = 0;
+    long long parties_served = 0;
+    long long total_time_served = 0;
+    long long players_rejected = 0;
+    bool paused = false;
+    bool draining = false;
+    bool idle = false;
+    unsigned long long applied_control_seq = 0;
+    std::vector<RegionSnapshot> regions;
+    unsigned long long heap_allocations = 0;
+    unsigned long long events_recorded = 0;
+    unsigned long long events_folded = 0;
+    size_t records_in_use = 0;
+    size_t record_slabs = 0;
+    long long former_wakeups = 0;
+    double former_wake_latency_total = 0;
+    double former_wake_latency_max = 0;
+    bool coordinated = false;  // scheduler=process
+    CoordinationStats coordination;
+    long long players_cooling_down = 0;
+    long long population_returns = 0;
+    long long staged_parties = 0;
+    PopulationBaseline population_baseline;
+};
+
+std::mutex snapshot_mutex;
+std::condition_variable snapshot_cv;
+SimulationSnapshot published_snapshot;
+
+// --- Control Queue ---
+// State-changing commands are queued here and applied in order by the party
+// former, which already holds g_mutex when it runs.
+struct ControlCommand {
+    CommandType type = CommandType::None;
+    long long amounts[ROLE_COUNT] = {0, 0, 0};
+    int region = 0;
+    int value = 0;
+    int duration_min = 0;
+    int duration_max = 0;
+    unsigned long long seed = 0;
+    unsigned long long seq = 0;
+};
+
+std::mutex control_mutex;
+std::vector<ControlCommand> control_queue;
+std::atomic<bool> control_pending(false);
+unsigned long long control_seq = 0;
+
+// --- Virtual-Time Simulation ---
+// A deterministic discrete-event model of the same queue rules (Poisson
+// arrivals, party template, first-free instances, integer run times) that
+// runs in virtual time on a private RNG, so many runs can go in parallel.
+struct VirtualRunParams {
+    int instances = 0;
+    int party[ROLE_COUNT] = {1, 1, 3};
+    double arrival_rate[ROLE_COUNT] = {0, 0, 0};
+    RateProfile profile[ROLE_COUNT];  // when set, replaces the role's constant rate
+    double bucket_seconds = 0;        // > 0 fills VirtualRunResult::buckets
+    double flex_rate = 0;     // flex players per second, able to play any role in flex_roles
+    int flex_roles = 0;
+    bool flex_pinned = false;  // flex players queue for one of their roles, picked at random
+    int min_time = 0;
+    std::vector<double> duration_pmf;  // P(run time == min_time + i)
+    double horizon = 0;
+};
+
+struct VirtualRunResult {
+    long long parties_formed = 0;
+    long long players_arrived[ROLE_COUNT] = {0, 0, 0};
+    long long players_matched[ROLE_COUNT] = {0, 0, 0};
+    long long flex_arrived = 0;
+    long long flex_matched[ROLE_COUNT] = {0, 0, 0};
+    double utilization = 0;
+    // Waits include players still queued at the horizon.
+    double mean_wait[ROLE_COUNT] = {0, 0, 0};
+    double p99_wait[ROLE_COUNT] = {0, 0, 0};
+    double flex_mean_wait = 0;
+    struct Bucket {
+        long long arrivals[ROLE_COUNT] = {0, 0, 0};
+        long long parties_formed = 0;
+        double busy_seconds = 0;
+        long long matched[ROLE_COUNT] = {0, 0, 0};
+        double wait_sum[ROLE_COUNT] = {0, 0, 0};
+        double max_wait = 0;
+        long long queue_at_end[ROLE_COUNT] = {0, 0, 0};
+    };
+    std::vector<Bucket> buckets;  // by the time of the arrival, match or run
+};
+
 // --- Forward Declarations ---
-void dungeon_run(int instance_id);
-void party_former();
+void dungeon_run(PartyRecord* party);
+void start_run(int region_index, int instance_id, int extra_seconds);
+void launch_run(PartyRecord* party);
+void begin_ready_check(int region_index, int instance_id, int extra_seconds, const PartySources& sources,
+                       std::chrono::steady_clock::time_point now);
+void resolve_ready_check(const PendingReadyCheck& check);
+void ready_check_timer();
+void schedule_return(int region_index, const long long* players, std::chrono::steady_clock::time_point now);
+void population_manager();
+int begin_run(PartyRecord& party);
+void complete_run(int region_index, int instance_id, int time_in_dungeon);
+void finish_run(int region_index, int instance_id, int time_in_dungeon);
+void record_event(EventType type, int region_index, int value, const long long* amounts, int duration,
+                  std::chrono::steady_clock::time_point when);
+void record_role_event(EventType type, const Region& region, int role, long long amount,
+                       std::chrono::steady_clock::time_point when);
+void fold_event(EventState& state, const SimEvent& event);
+bool open_event_journal(const std::string& path);
+void event_journal();
+std::string verify_event_state();
+int replay_events(const std::string& path, std::optional<double> until);
+bool spawn_workers(int count);
+void worker_listener();
+void flush_worker_assignments(std::unique_lock<std::mutex>& lock);
+void stop_workers(const std::string& thread_name);
+bool create_shared_state(const std::string& name, int capacity);
+void write_shared_state(const SimulationSnapshot& snapshot);
+void mark_status_changed(int region_index, int instance_id);
+void destroy_shared_state();
+int dump_shared_state(const std::string& name);
+void timer_scheduler();
+bool load_config_file(const std::string& path, SimulationConfig& config);
+bool apply_config_value(SimulationConfig& config, std::string_view key, std::string_view value, std::string& error);
+bool parse_command_line(int argc, char* argv[], SimulationConfig& config);
+void party_former(int region_index);
 void input_handler();
-void print_status(const std::string& thread_name);
-bool can_form_party();
-int find_free_instance();
+void run_interactive_input(const std::string& thread_name);
+void run_batch_input(const std::string& thread_name);
+Command parse_command(std::string_view line);
+void execute_command(const std::string& thread_name, const Command& command);
+ControlCommand to_control(const Command& command);
+SimulationSnapshot snapshot_after_controls();
+bool queues_bounded();
+std::string describe_matching(const SimulationSnapshot& snapshot);
+std::string describe_flex(const SimulationSnapshot& snapshot);
+std::string describe_staging(const SimulationSnapshot& snapshot);
+std::string describe_ready_checks(const SimulationSnapshot& snapshot);
+std::string describe_population(const SimulationSnapshot& snapshot);
+std::string describe_profile();
+std::string describe_backpressure(const SimulationSnapshot& snapshot);
+std::string describe_status(const SimulationSnapshot& snapshot);
+std::string describe_stats(const SimulationSnapshot& snapshot);
+void request_shutdown();
+void control_server();
+std::string handle_control_line(std::string_view line);
+void apply_adds(const std::string& thread_name, int region_index, const long long (&amounts)[ROLE_COUNT],
+                const std::string& message);
+long long saturating_add(long long a, long long b);
+template <typename T> bool prompt_value(const char* prompt, T min_value, T max_value, T& target);
+unsigned long long post_control(ControlCommand command);
+void apply_control_commands(const std::string& thread_name);
+void publish_snapshot();
+SimulationSnapshot read_snapshot();
+template <typename Predicate> SimulationSnapshot wait_for_snapshot(Predicate predicate);
+void print_status(const Region& region, const std::string& thread_name);
+std::string region_thread_name(const char* base, int region_index);
+int find_region(std::string_view name);
+void enqueue_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now);
+void dequeue_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now);
+void requeue_players_at_front(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now);
+void requeue_flex_players_at_front(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now);
+void admit_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now,
+                   std::ostream& report);
+bool admit_backlogs(std::chrono::steady_clock::time_point now);
+void evict_oldest_players(Region& region, int role, long long amount);
+bool can_form_party(const Region& region);
+long long max_local_parties(const Region& region);
+void assign_flex_players(const Region& region, long long (&deficit)[ROLE_COUNT],
+                         long long (&taken)[ROLE_MASKS][ROLE_COUNT]);
+void enqueue_flex_players(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now);
+void dequeue_flex_players(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now);
+std::string role_mask_name(int mask);
+bool can_borrow_party(const Region& region);
+std::optional<std::chrono::steady_clock::time_point> overflow_deadline(const Region& region);
+long long formable_parties(const Region& region);
+bool batch_due(Region& region, std::chrono::steady_clock::time_point now);
+std::optional<std::chrono::steady_clock::time_point> batch_deadline(const Region& region);
+int player_rating(int region_index, int role, long long arrival);
+void form_batch(int region_index, const std::string& thread_name, std::chrono::steady_clock::time_point now);
+void form_party(int region_index, const std::string& thread_name, std::chrono::steady_clock::time_point now);
+void dispatch_party(int region_index, const StagedParty& party, const long long* local, const std::string& thread_name,
+                    std::chrono::steady_clock::time_point now);
+void party_dispatcher(int region_index);
+long long formation_slots(const Region& region);
+bool has_free_instance(const Region& region);
+int acquire_free_instance(Region& region);
+void release_instance(Region& region, int instance_id);
+void resize_instance_pool(Region& region, int new_limit);
+void rerank(std::set<std::pair<long long, int>>& ranks, long long before, long long after, int id);
+void account_idle_time(Region& region, std::chrono::steady_clock::time_point now);
+void record_busy_interval(DungeonInstance& instance, std::chrono::steady_clock::time_point started,
+                          std::chrono::steady_clock::time_point ended);
+bool export_timeline(const std::string& path, int buckets, double uptime);
+std::unique_ptr<InstanceSelector> make_instance_selector(InstancePolicy policy, unsigned long long seed,
+                                                         const std::vector<DungeonInstance>& instances);
+std::vector<std::vector<int>> detect_numa_nodes();
+bool pin_current_thread(const std::vector<int>& cpus);
+bool parse_cpu_list(std::string_view list, std::vector<int>& cpus);
+bool apply_thread_placement(const ThreadPlacement& placement, int former_index, std::string& error);
+void place_worker_thread(const std::string& thread_name, int region_index);
+void note_wake_request();
+void rehome_instances(Region& region);
+int run_numa_benchmark();
 bool is_simulation_idle();
+bool stdin_is_terminal();
+size_t read_available_input(char* data, size_t size);
+bool read_input_line(std::string& pending, std::string& line);
+std::vector<double> duration_pmf(DurationDistribution distribution, int lo, int hi);
+unsigned long long mix_seed(unsigned long long base, unsigned long long index);
+VirtualRunResult run_virtual_simulation(const VirtualRunParams& params, unsigned long long seed);
+double profile_rate(const RateProfile& profile, double t);
+double profile_mean(const RateProfile& profile);
+double next_profile_arrival(const RateProfile& profile, double t, std::mt19937_64& gen);
+int run_profile_report(const SimulationConfig& config);
+void arrival_generator();
+int run_flex_comparison(const SimulationConfig& config);
+int run_capacity_analysis(const SimulationConfig& config);
+int run_instance_search(const SimulationConfig& config);
+int run_monte_carlo(const SimulationConfig& config);
+bool build_virtual_params(const SimulationConfig& config, bool need_instances, VirtualRunParams& params);
+int find_bottleneck(const VirtualRunParams& params, bool (&limiting)[ROLE_COUNT]);
 
 // --- Function Implementations ---
 
+// Exponential and normal draws are centred on the midpoint of
+// [min_time, max_time] and clamped to it, so every choice honours the bounds.
+// duration_pmf() must describe the same distributions.
 int get_random_time() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_int_distribution<> distrib(min_time, max_time);
     std::lock_guard<std::mutex> lock(rng_mutex);
-    return distrib(gen);
+    switch (duration_distribution) {
+    case DurationDistribution::Exponential: {
+        double mean = (max_time - min_time) / 2.0;
+        if (mean <= 0) return min_time;
+        std::exponential_distribution<> distrib(1.0 / mean);
+        return std::min(max_time, min_time + static_cast<int>(std::lround(distrib(rng))));
+    }
+    case DurationDistribution::Normal: {
+        double spread = (max_time - min_time) / 6.0;
+        if (spread <= 0) return min_time;
+        std::normal_distribution<> distrib((min_time + max_time) / 2.0, spread);
+        return std::clamp(static_cast<int>(std::lround(distrib(rng))), min_time, max_time);
+    }
+    case DurationDistribution::Uniform:
+        break;
+    }
+    std::uniform_int_distribution<> distrib(min_time, max_time);
+    return distrib(rng);
+}
+
+// Queue counters saturate instead of wrapping: stress runs push billions of
+// synthetic players and a wrapped counter would read as a huge negative queue.
+long long saturating_add(long long a, long long b) {
+    if (b > 0 && a > std::numeric_limits<long long>::max() - b) return std::numeric_limits<long long>::max();
+    if (b < 0 && a < std::numeric_limits<long long>::min() - b) return std::numeric_limits<long long>::min();
+    return a + b;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     start_time = std::chrono::steady_clock::now();
     const std::string thread_name = "MainThread";
 
+    SimulationConfig config;
+    if (!parse_command_line(argc, argv, config)) return 1;
+    if (config.show_help) return 0;
+    if (config.analyze) return run_capacity_analysis(config);
+    if (config.find_min_instances) return run_instance_search(config);
+    if (config.replications > 0) return run_monte_carlo(config);
+    if (config.flex_compare) return run_flex_comparison(config);
+    if (config.profile_report) return run_profile_report(config);
+    if (!config.shm_dump.empty()) return dump_shared_state(config.shm_dump);
+    if (!config.replay.empty()) return replay_events(config.replay, config.replay_until);
+    if (config.numa_benchmark) return run_numa_benchmark();
+
     // --- Input ---
-    int n;
+    // With [region.*] config every region brings its own instances and queue.
+    bool regional = !config.regions.empty();
+    int n = 0;
+    long long initial_queue[ROLE_COUNT] = {0, 0, 0};
     log_message(thread_name, "--- LFG Dungeon Queue Simulator ---");
-    std::cout << "Enter max number of concurrent instances (n): "; std::cin >> n;
-    std::cout << "Enter number of tanks in queue (t): "; std::cin >> tank_queue;
-    std::cout << "Enter number of healers in queue (h): "; std::cin >> healer_queue;
-    std::cout << "Enter number of DPS in queue (d): "; std::cin >> dps_queue;
-    std::cout << "Enter minimum dungeon time in seconds (t1): "; std::cin >> min_time;
-    std::cout << "Enter maximum dungeon time in seconds (t2): "; std::cin >> max_time;
+    bool prompted = false;
+    bool valid = true;
+    auto value_or_prompt = [&](const auto& configured, const char* prompt, auto min_value, auto max_value, auto& target) {
+        if (!valid) return;
+        if (configured) {
+            target = *configured;
+            return;
+        }
+        valid = prompt_value(prompt, min_value, max_value, target);
+        prompted = true;
+    };
+    if (!regional) {
+        value_or_prompt(config.instances, "Enter max number of concurrent instances (n): ", 1, max_instances, n);
+        value_or_prompt(config.queue[ROLE_TANK], "Enter number of tanks in queue (t): ", 0LL, max_queue_size,
+                        initial_queue[ROLE_TANK]);
+        value_or_prompt(config.queue[ROLE_HEALER], "Enter number of healers in queue (h): ", 0LL, max_queue_size,
+                        initial_queue[ROLE_HEALER]);
+        value_or_prompt(config.queue[ROLE_DPS], "Enter number of DPS in queue (d): ", 0LL, max_queue_size,
+                        initial_queue[ROLE_DPS]);
+    }
+    value_or_prompt(config.min_time, "Enter minimum dungeon time in seconds (t1): ", 0, max_run_seconds, min_time);
+    value_or_prompt(config.max_time, "Enter maximum dungeon time in seconds (t2): ", 0, max_run_seconds, max_time);
+    if (!valid) {
+        log_message(thread_name, "Error: invalid startup parameters. Exiting.");
+        return 1;
+    }
     
-    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    if (prompted) std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    std::copy(std::begin(config.party), std::end(config.party), party_template);
+    duration_distribution = config.distribution;
+    log_level = config.log_level;
+    run_scheduler = config.scheduler;
+    control_socket_path = config.control_socket;
+    instance_policy = config.instance_policy;
+    overflow_after = config.overflow_after;
+    batch_window = config.batch_window;
+    summary_instances = config.summary_instances;
+    timeline_path = config.timeline;
+    timeline_buckets = config.timeline_buckets;
+    batch_max_parties = config.batch_max_parties;
+    staging_capacity = config.staging_capacity;
+    ready_check_timeout = config.ready_check_timeout;
+    ready_check_decline = config.ready_check_decline;
+    ready_check_response = config.ready_check_response;
+    closed_population = config.closed_population;
+    population_cooldown = config.population_cooldown;
+    population_warmup = config.population_warmup;
+    std::copy(std::begin(config.arrival_profile), std::end(config.arrival_profile), arrival_profiles);
+    profile_time_scale = config.profile_time_scale;
+    std::copy(std::begin(config.queue_capacity), std::end(config.queue_capacity), queue_capacity);
+    admission_policy = config.admission_policy;
+    former_placement = config.former_placement;
+    worker_placement = config.worker_placement;
+    cross_region_penalty = config.cross_region_penalty;
+    if (config.seed) rng.seed(static_cast<std::mt19937::result_type>(*config.seed));
+    unsigned long long selector_seed = config.seed ? *config.seed : std::random_device{}();
+    rating_seed = mix_seed(selector_seed, ~0ULL);
+    ready_check_rng.seed(mix_seed(selector_seed, ~1ULL));
+    arrival_seed = mix_seed(selector_seed, ~2ULL);
+
+    regions.resize(regional ? config.regions.size() : 1);
+    if (config.numa) {
+        numa_nodes = detect_numa_nodes();
+        std::stringstream numa_ss;
+        if (numa_nodes.empty()) numa_ss << "NUMA: topology unavailable; placement disabled.";
+        else numa_ss << "NUMA: " << numa_nodes.size() << " node(s); regions are homed round-robin.";
+        if (numa_nodes.size() > regions.size()) numa_ss << " Define at least one region per node to use every node.";
+        log_message(thread_name, numa_ss.str());
+    }
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (regional) regions[i].name = config.regions[i].name;
+        regions[i].accounted_until = start_time;
+        regions[i].staged.resize(static_cast<size_t>(staging_capacity));
+        if (!numa_nodes.empty()) regions[i].node = static_cast<int>(i % numa_nodes.size());
+        regions[i].selector = make_instance_selector(instance_policy, i == 0 ? selector_seed : mix_seed(selector_seed, i),
+                                                     regions[i].instances);
+    }
 
     if (min_time > max_time) {
         log_message(thread_name, "Warning: Min time > Max time. Swapping values.");
@@ -90,33 +1158,242 @@ int main() {
     }
     
     log_message(thread_name, "----------------------------------------");
-    for (int i = 0; i < n; ++i) instances.emplace_back(i);
-    
+    if (!config.shm_name.empty()) {
+        int initial = regional ? 0 : n;
+        for (const auto& region : config.regions) initial = std::max(initial, *region.instances);
+        if (!create_shared_state(config.shm_name, config.shm_capacity ? config.shm_capacity : std::max(initial, 1024))) {
+            log_message(thread_name, "Error: could not create shared memory segment '" + config.shm_name + "'. Exiting.");
+            return 1;
+        }
+    }
+
     std::stringstream ss;
-    ss << "Initial Queue: " << tank_queue << "T, " << healer_queue << "H, " << dps_queue << "D";
-    log_message(thread_name, ss.str());
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (size_t i = 0; i < regions.size(); ++i) {
+            Region& region = regions[i];
+            resize_instance_pool(region, regional ? *config.regions[i].instances : n);
+            std::stringstream report;
+            for (int role = 0; role < ROLE_COUNT; ++role) {
+                long long amount = regional ? config.regions[i].queue[role].value_or(0) : initial_queue[role];
+                admit_players(region, role, amount, start_time, report);
+            }
+            if (report.tellp() > 0) log_message(thread_name, report.str());
+            ss.str(""); ss.clear();
+            ss << "Initial Queue" << (regional ? " (" + region.name + ")" : "") << ": " << region.queue[ROLE_TANK]
+               << "T, " << region.queue[ROLE_HEALER] << "H, " << region.queue[ROLE_DPS] << "D";
+            if (regional) ss << ", " << region.instance_limit << " instance(s)";
+            log_message(thread_name, ss.str());
+        }
+        publish_snapshot();
+    }
+    event_checkpoint_every = config.event_checkpoint_every;
+    if (!config.event_log.empty() && !open_event_journal(config.event_log)) {
+        log_message(thread_name, "Error: could not open event log '" + config.event_log + "'. Exiting.");
+        return 1;
+    }
+    // Workers are forked before any other thread exists.
+    if (run_scheduler == RunScheduler::Process && !spawn_workers(config.workers)) {
+        log_message(thread_name, "Error: could not start worker processes. Exiting.");
+        return 1;
+    }
+#ifndef _WIN32
+    if (pipe(shutdown_pipe) != 0) {
+        log_message(thread_name, "Error: could not create the shutdown pipe. Exiting.");
+        return 1;
+    }
+#endif
     log_message(thread_name, "Starting Phase 1: Processing initial queue...");
 
     // --- Start Simulation Threads ---
-    std::thread former_thread(party_former);
+    std::thread journal_thread(event_journal);
+    std::thread timer_thread;
+    if (run_scheduler == RunScheduler::Timer) timer_thread = std::thread(timer_scheduler);
+    std::thread listener_thread;
+    if (run_scheduler == RunScheduler::Process) listener_thread = std::thread(worker_listener);
+    std::thread ready_check_thread;
+    if (ready_check_timeout > 0) ready_check_thread = std::thread(ready_check_timer);
+    std::thread population_thread;
+    if (closed_population) population_thread = std::thread(population_manager);
+    std::thread arrival_thread;
+    if (profiled_arrivals()) arrival_thread = std::thread(arrival_generator);
+    std::vector<std::thread> former_threads;
+    for (size_t i = 0; i < regions.size(); ++i) former_threads.emplace_back(party_former, static_cast<int>(i));
+    std::vector<std::thread> dispatcher_threads;
+    for (size_t i = 0; i < regions.size() && staging_capacity > 0; ++i) {
+        dispatcher_threads.emplace_back(party_dispatcher, static_cast<int>(i));
+    }
     std::thread input_thread(input_handler);
+    std::thread control_thread;
+    if (!control_socket_path.empty()) control_thread = std::thread(control_server);
 
-    if (input_thread.joinable()) input_thread.join();
+    {
+        std::unique_lock<std::mutex> lock(shutdown_mutex);
+        shutdown_cv.wait(lock, [] { return !simulation_running; });
+    }
     
     // --- Shutdown ---
     log_message(thread_name, "Shutdown initiated. Waiting for threads to terminate...");
-    if (former_thread.joinable()) former_thread.join();
+    // A quit from the control socket wakes the input thread through the shutdown pipe.
+    if (control_thread.joinable()) control_thread.join();
+    input_thread.join();
+    for (auto& former_thread : former_threads) former_thread.join();
+    for (auto& dispatcher_thread : dispatcher_threads) dispatcher_thread.join();
+    if (population_thread.joinable()) population_thread.join();
+    if (arrival_thread.joinable()) arrival_thread.join();
+    if (ready_check_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(ready_check_mutex);
+            ready_check_stopping = true;
+        }
+        ready_check_cv.notify_all();
+        ready_check_thread.join();
+    }
+    if (timer_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(timer_mutex);
+            timer_stopping = true;
+        }
+        timer_cv.notify_all();
+        timer_thread.join();
+    }
+    if (listener_thread.joinable()) {
+        stop_workers(thread_name);
+        listener_thread.join();
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        journal_stopping = true;
+    }
+    journal_cv.notify_all();
+    journal_thread.join();
+#ifndef _WIN32
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
+#endif
     
+    destroy_shared_state();
     log_message(thread_name, "Simulation finished. All threads terminated.");
     log_message(thread_name, "--- Final Instance Summary ---");
-    for (const auto& instance : instances) {
+    auto finished = std::chrono::steady_clock::now();
+    double uptime = std::chrono::duration<double>(finished - start_time).count();
+    long long remaining[ROLE_COUNT] = {0, 0, 0};
+    for (auto& region : regions) account_idle_time(region, finished);
+    for (const auto& region : regions) {
+        if (regional) log_message(thread_name, "Region " + region.name + ":");
+        // Aggregates are kept current on every completion, so only the listing scales with n.
+        size_t count = region.instances.size();
+        size_t listed = summary_instances < 0 ? (count <= 32 ? count : 5) : static_cast<size_t>(summary_instances);
+        if (listed * 2 >= count) {
+            for (const auto& instance : region.instances) {
+                ss.str(""); ss.clear();
+                ss << "Instance " << instance.id << ": Served " << instance.parties_served 
+                   << " parties. Total time active: " << instance.total_time_served << "s.";
+                log_message(thread_name, ss.str());
+            }
+        } else if (listed > 0) {
+            auto list = [&region, listed](auto first) {
+                std::stringstream out;
+                for (size_t i = 0; i < listed; ++i, ++first) {
+                    const DungeonInstance& instance = region.instances[first->second];
+                    out << (i ? ", " : "") << instance.id << " (" << instance.parties_served << " parties, "
+                        << instance.total_time_served << "s)";
+                }
+                return out.str();
+            };
+            log_message(thread_name, "Busiest instances: " + list(region.by_parties.rbegin()) + ".");
+            log_message(thread_name, "Least used instances: " + list(region.by_parties.begin()) + ".");
+        }
+        if (count > 0) {
+            ss.str(""); ss.clear();
+            ss << std::fixed << std::setprecision(2) << "Load spread: " << region.by_parties.begin()->first << "-"
+               << region.by_parties.rbegin()->first << " parties per instance (" << count << " instances), mean "
+               << double(region.parties_served) / count << " | Run time " << region.by_time.begin()->first << "-"
+               << region.by_time.rbegin()->first << "s per instance, mean " << double(region.total_time_served) / count
+               << "s | Utilization "
+               << (uptime > 0 && region.instance_limit ? 100.0 * region.total_time_served / (uptime * region.instance_limit) : 0.0)
+               << "%.";
+            log_message(thread_name, ss.str());
+        }
+        ss.str(""); ss.clear();
+        ss << std::fixed << std::setprecision(2) << "Idle instance time: " << region.idle_starved_seconds
+           << "s short of a role, " << region.idle_empty_seconds << "s with an empty queue, " << region.idle_held_seconds
+           << "s with a party held back | Capacity-limited " << region.capacity_limited_seconds << "s.";
+        log_message(thread_name, ss.str());
+        if (regional) {
+            ss.str(""); ss.clear();
+            ss << std::fixed << std::setprecision(2) << "Throughput: " << region.parties_served << " parties served ("
+               << region.cross_region_parties << " cross-region), "
+               << (uptime > 0 ? 60.0 * region.parties_served / uptime : 0.0) << " parties/min, avg wait "
+               << (region.players_matched ? region.total_wait_seconds / region.players_matched : 0.0) << "s.";
+            log_message(thread_name, ss.str());
+        }
+        for (int role = 0; role < ROLE_COUNT; ++role) remaining[role] = saturating_add(remaining[role], region.queue[role]);
+    }
+    if (!timeline_path.empty()) {
+        long long intervals = 0, bytes = 0;
+        for (const auto& region : regions) {
+            for (const auto& instance : region.instances) {
+                intervals += instance.timeline_intervals;
+                bytes += static_cast<long long>(instance.timeline.size());
+            }
+        }
+        ss.str(""); ss.clear();
+        if (export_timeline(timeline_path, timeline_buckets, uptime)) {
+            ss << std::fixed << std::setprecision(2) << "Timeline: " << intervals << " busy intervals in " << bytes
+               << " bytes (" << (intervals ? double(bytes) / intervals : 0.0) << " bytes/interval), heatmap written to "
+               << timeline_path << ".";
+        } else {
+            ss << "Error: could not write timeline '" << timeline_path << "'.";
+        }
+        log_message(thread_name, ss.str());
+    }
+    for (size_t i = 0; i < workers.size(); ++i) {
+        log_message(thread_name, "Worker " + std::to_string(i) + " (pid " + std::to_string(workers[i]->pid) + "): "
+                                 + (workers[i]->report.empty() ? "no report" : workers[i]->report));
+    }
+    if (!workers.empty()) {
+        ss.str(""); ss.clear();
+        ss << std::fixed << std::setprecision(3) << "Coordination: " << coordination.assignments << " assignments in "
+           << coordination.assignment_batches << " batches, " << coordination.completions << " completions in "
+           << coordination.completion_batches << " batches, " << coordination.bytes << " bytes | Overhead per run "
+           << (coordination.completions ? 1000.0 * coordination.overhead_seconds / coordination.completions : 0.0)
+           << "ms mean, " << 1000.0 * coordination.max_overhead_seconds << "ms max";
+        log_message(thread_name, ss.str());
+    }
+    {
+        long long formed = 0;
+        for (const auto& region : regions) formed += region.parties_formed;
+        unsigned long long allocations = heap_allocations.load();
         ss.str(""); ss.clear();
-        ss << "Instance " << instance.id << ": Served " << instance.parties_served 
-           << " parties. Total time active: " << instance.total_time_served << "s.";
+        ss << std::fixed << std::setprecision(3) << "Heap: " << allocations << " allocations, "
+           << (formed ? double(allocations) / formed : 0.0) << " per party formed";
         log_message(thread_name, ss.str());
     }
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            publish_snapshot();
+        }
+        SimulationSnapshot final_snapshot = read_snapshot();
+        if (batch_window > 0) log_message(thread_name, describe_matching(final_snapshot));
+        if (queues_bounded()) log_message(thread_name, describe_backpressure(final_snapshot));
+        std::string flex = describe_flex(final_snapshot);
+        if (!flex.empty()) log_message(thread_name, flex + ".");
+        if (staging_capacity > 0) log_message(thread_name, describe_staging(final_snapshot) + ".");
+        if (ready_check_timeout > 0) log_message(thread_name, describe_ready_checks(final_snapshot) + ".");
+        if (closed_population) log_message(thread_name, describe_population(final_snapshot) + ".");
+    }
+    log_message(thread_name, verify_event_state());
     ss.str(""); ss.clear();
-    ss << "Remaining players in queue: " << tank_queue << "T, " << healer_queue << "H, " << dps_queue << "D";
+    long long flex_remaining = 0;
+    for (const auto& region : regions) {
+        for (long long queued : region.flex) flex_remaining = saturating_add(flex_remaining, queued);
+    }
+    ss << "Remaining players in queue: " << remaining[ROLE_TANK] << "T, " << remaining[ROLE_HEALER] << "H, "
+       << remaining[ROLE_DPS] << "D";
+    if (flex_remaining > 0) ss << ", " << flex_remaining << " flex";
     log_message(thread_name, ss.str());
 
     return 0;
@@ -125,169 +1402,4698 @@ int main() {
 void input_handler() {
     const std::string thread_name = "InputHandler";
     
-    {
-        std::unique_lock<std::mutex> lock(g_mutex);
-        if (!is_simulation_idle()) {
-             cv.wait(lock, is_simulation_idle);
-        }
-    }
+    if (!open_ended_run()) wait_for_snapshot([](const SimulationSnapshot& snapshot) { return snapshot.idle; });
 
     log_message(thread_name, "----------------------------------------");
-    log_message(thread_name, "Initial queue processed. Entering Manual Control.");
+    log_message(thread_name, closed_population    ? "Closed population running. Entering Manual Control."
+                             : profiled_arrivals() ? "Arrival profile running. Entering Manual Control."
+                                                   : "Initial queue processed. Entering Manual Control.");
     
-    std::string line;
-    while (simulation_running) {
+    if (stdin_is_terminal()) run_interactive_input(thread_name);
+    else run_batch_input(thread_name);
 
-        int current_tanks, current_healers, current_dps;
-        {
-            std::lock_guard<std::mutex> lock(g_mutex);
-            current_tanks = tank_queue;
-            current_healers = healer_queue;
-            current_dps = dps_queue;
-        }
+    if (simulation_running && !control_socket_path.empty()) {
+        log_message(thread_name, "Input closed. Control socket remains active.");
+        return;
+    }
+
+    log_message(thread_name, "Shutting down.");
+    request_shutdown();
+}
+
+void run_interactive_input(const std::string& thread_name) {
+    std::string line, pending;
+    while (simulation_running) {
 
+        SimulationSnapshot snapshot = read_snapshot();
         {
             std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "\nQueue: " << current_tanks << "T, " << current_healers << "H, " << current_dps << "D"
-                      << " | Commands: add <role> <amount> | quit\n> ";
+            std::cout << "\nQueue: " << snapshot.tanks << "T, " << snapshot.healers << "H, " << snapshot.dps << "D"
+                      << " | Commands: add <role[,role]> <amount> [region] | status | stats | scale <n> [region] | pause | resume"
+                      << " | drain | seed <value> | set duration <min> <max> | quit\n> ";
         }
         
-        if (!std::getline(std::cin, line)) {
-            simulation_running = false;
+        if (!read_input_line(pending, line)) break;
+
+        Command command = parse_command(line);
+        switch (command.type) {
+        case CommandType::Add: {
+            long long amounts[ROLE_COUNT] = {0, 0, 0};
+            amounts[command.role] = command.amount;
+            std::stringstream log_ss;
+            log_ss << "Added " << command.amount << " " << command.word << "(s)";
+            if (regions.size() > 1) log_ss << " to " << regions[command.region].name;
+            log_ss << ". Processing...";
+            apply_adds(thread_name, command.region, amounts, log_ss.str());
             break;
         }
+        default:
+            execute_command(thread_name, command);
+            break;
+        }
+    }
+}
 
-        std::stringstream ss(line);
-        std::string command;
-        ss >> command;
+// Piped input is read as it becomes available, up to a large chunk at a time,
+// and consecutive adds within what has arrived are coalesced per role, so a
+// script of a million adds costs a few queue updates while a slow driver's
+// commands still run as soon as their line is complete. Any other valid
+// command, or an add for another region, flushes the pending adds first to
+// keep ordering.
+void run_batch_input(const std::string& thread_name) {
+    constexpr size_t chunk_size = 1 << 16;
+    std::vector<char> buffer(chunk_size * 2);
+    size_t pending_bytes = 0;
+    long long amounts[ROLE_COUNT] = {0, 0, 0};
+    int batch_region = 0;
+    long long batched_commands = 0;
+    bool at_eof = false;
 
-        if (command == "add") {
-            std::string role;
-            int amount;
-            ss >> role >> amount;
+    auto flush = [&] {
+        if (batched_commands == 0 || !simulation_running) return;
+        std::stringstream log_ss;
+        log_ss << "Added " << amounts[ROLE_TANK] << "T, " << amounts[ROLE_HEALER] << "H, "
+               << amounts[ROLE_DPS] << "D";
+        if (regions.size() > 1) log_ss << " to " << regions[batch_region].name;
+        log_ss << " from " << batched_commands << " add command(s). Processing...";
+        apply_adds(thread_name, batch_region, amounts, log_ss.str());
+        std::fill(std::begin(amounts), std::end(amounts), 0);
+        batched_commands = 0;
+    };
 
-            if (ss.fail() || amount <= 0) {
-                log_message(thread_name, "Invalid input. Usage: add <role> <amount>");
-                continue;
-            }
+    while (simulation_running && !at_eof) {
+        if (buffer.size() - pending_bytes < chunk_size) buffer.resize(pending_bytes + chunk_size);
+        size_t read = read_available_input(buffer.data() + pending_bytes, chunk_size);
+        if (read == 0) {
+            at_eof = true;
+            if (pending_bytes == 0) break;
+            buffer[pending_bytes++] = '\n';  // terminate a final unterminated line
+        }
+        size_t filled = pending_bytes + read;
 
-            {
-                std::lock_guard<std::mutex> lock(g_mutex);
-                if (role == "tank" || role == "t") tank_queue += amount;
-                else if (role == "healer" || role == "h") healer_queue += amount;
-                else if (role == "dps" || role == "d") dps_queue += amount;
-                else {
-                    log_message(thread_name, "Invalid role. Use 'tank', 'healer', or 'dps'.");
-                    continue;
-                }
-                
-                std::stringstream log_ss;
-                log_ss << "Added " << amount << " " << role << "(s). Processing...";
-                log_message(thread_name, log_ss.str());
-            }
-            cv.notify_all();
+        std::string_view data(buffer.data(), filled);
+        size_t line_start = 0;
+        size_t newline;
+        while (simulation_running && (newline = data.find('\n', line_start)) != std::string_view::npos) {
+            Command command = parse_command(data.substr(line_start, newline - line_start));
+            line_start = newline + 1;
 
-            {
-                std::unique_lock<std::mutex> lock(g_mutex);
-                cv.wait(lock, is_simulation_idle);
-                log_message(thread_name, "Processing complete. Ready for next command.");
+            switch (command.type) {
+            case CommandType::Add:
+                // Flush rather than saturate, so the queue update reports what it rejected.
+                if (command.region != batch_region || amounts[command.role] > max_queue_size - command.amount) flush();
+                batch_region = command.region;
+                amounts[command.role] += command.amount;
+                batched_commands++;
+                break;
+            case CommandType::None:
+                break;
+            case CommandType::Invalid:
+            case CommandType::Unknown:
+                execute_command(thread_name, command);
+                break;
+            default:
+                flush();
+                execute_command(thread_name, command);
+                break;
             }
-
-        } else if (command == "quit" || command == "exit") {
-            simulation_running = false;
-        } else if (!command.empty()) {
-            log_message(thread_name, "Unknown command: '" + command + "'");
         }
+
+        pending_bytes = filled - line_start;
+        std::copy(buffer.begin() + line_start, buffer.begin() + filled, buffer.begin());
+        // Nothing more has arrived yet; apply what we have before blocking again.
+        flush();
     }
 
-    log_message(thread_name, "Shutting down.");
-    cv.notify_all();
+    flush();
 }
 
+namespace {
 
-void party_former() {
-    const std::string thread_name = "PartyFormer";
-    while (true) {
-        std::unique_lock<std::mutex> lock(g_mutex);
-        cv.wait(lock, [] {
-            bool has_work_to_do = can_form_party() && find_free_instance() != -1;
-            bool is_shutting_down = !simulation_running;
-            return has_work_to_do || is_shutting_down;
-        });
+std::string_view next_token(std::string_view& rest) {
+    size_t begin = rest.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos) {
+        rest = {};
+        return {};
+    }
+    size_t end = rest.find_first_of(" \t\r", begin);
+    if (end == std::string_view::npos) end = rest.size();
+    std::string_view token = rest.substr(begin, end - begin);
+    rest.remove_prefix(end);
+    return token;
+}
 
-        if (!simulation_running && active_parties == 0) {
-            log_message(thread_name, "Shutdown signal received and no more work to do. Exiting.");
-            return;
-        }
+template <typename T>
+bool parse_number(std::string_view token, T& value) {
+    if (token.empty()) return false;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+int parse_role(std::string_view role) {
+    if (role == "tank" || role == "t") return ROLE_TANK;
+    if (role == "healer" || role == "h") return ROLE_HEALER;
+    if (role == "dps" || role == "d") return ROLE_DPS;
+    return -1;
+}
 
-        while (can_form_party() && find_free_instance() != -1) {
-            int instance_id = find_free_instance();
-            tank_queue--; healer_queue--; dps_queue -= 3;
-            instances[instance_id].status = "active";
-            active_parties++;
+// "tank,dps" (or "tank/dps") -> a role bitmask; 0 if any name is unknown.
+int parse_role_mask(std::string_view list) {
+    int mask = 0;
+    while (!list.empty()) {
+        size_t separator = list.find_first_of(",/");
+        int role = parse_role(list.substr(0, separator));
+        if (role < 0) return 0;
+        mask |= 1 << role;
+        if (separator == std::string_view::npos) break;
+        list.remove_prefix(separator + 1);
+    }
+    return mask;
+}
 
-            std::stringstream ss;
-            ss << "Party formed! Assigning to Instance " << instance_id 
-               << ". Remaining Queue: " << tank_queue << "T, " << healer_queue << "H, " << dps_queue << "D";
-            log_message(thread_name, ss.str());
-            
-            print_status(thread_name);
-            log_message(thread_name, "----------------------------------------");
+} // namespace
 
-            std::thread(dungeon_run, instance_id).detach();
+Command parse_command(std::string_view line) {
+    Command command;
+    std::string_view word = next_token(line);
+    command.word = word;
+
+    if (word.empty()) {
+        command.type = CommandType::None;
+    } else if (word == "add") {
+        std::string_view role = next_token(line);
+        std::string_view amount = next_token(line);
+        std::string_view region = next_token(line);
+        if (role.empty() || !parse_number(amount, command.amount) || command.amount <= 0) {
+            command.type = CommandType::Invalid;
+            command.error = "Invalid input. Usage: add <role> <amount> [region]";
+        } else if ((command.role = parse_role_mask(role)) == 0) {
+            command.type = CommandType::Invalid;
+            command.error = "Invalid role. Use 'tank', 'healer', 'dps', or a flex list like 'tank,dps'.";
+        } else if (!region.empty() && (command.region = find_region(region)) < 0) {
+            command.type = CommandType::Invalid;
+            command.error = "Unknown region.";
+        } else if (command.role & (command.role - 1)) {
+            command.type = CommandType::AddFlex;
+            command.word = role;
+        } else {
+            command.type = CommandType::Add;
+            command.role = parse_role(role);
+            command.word = role;
+        }
+    } else if (word == "quit" || word == "exit") {
+        command.type = CommandType::Quit;
+    } else if (word == "status") {
+        command.type = CommandType::Status;
+    } else if (word == "stats") {
+        command.type = CommandType::Stats;
+    } else if (word == "pause") {
+        command.type = CommandType::Pause;
+    } else if (word == "resume") {
+        command.type = CommandType::Resume;
+    } else if (word == "drain") {
+        command.type = CommandType::Drain;
+    } else if (word == "scale") {
+        std::string_view amount = next_token(line);
+        std::string_view region = next_token(line);
+        if (!parse_number(amount, command.amount) || command.amount < 0 || command.amount > max_instances) {
+            command.type = CommandType::Invalid;
+            command.error = "Invalid input. Usage: scale <instances> [region] (0-1000000)";
+        } else if (!region.empty() && (command.region = find_region(region)) < 0) {
+            command.type = CommandType::Invalid;
+            command.error = "Unknown region.";
+        } else {
+            command.type = CommandType::Scale;
+        }
+    } else if (word == "seed") {
+        if (!parse_number(next_token(line), command.seed)) {
+            command.type = CommandType::Invalid;
+            command.error = "Invalid input. Usage: seed <value>";
+        } else {
+            command.type = CommandType::Seed;
+        }
+    } else if (word == "set") {
+        if (next_token(line) != "duration" || !parse_number(next_token(line), command.duration_min)
+            || !parse_number(next_token(line), command.duration_max)
+            || command.duration_min < 0 || command.duration_max < 0
+            || command.duration_min > max_run_seconds || command.duration_max > max_run_seconds) {
+            command.type = CommandType::Invalid;
+            command.error = "Invalid input. Usage: set duration <min> <max> (0-86400 seconds)";
+        } else {
+            command.type = CommandType::SetDuration;
+            if (command.duration_min > command.duration_max) std::swap(command.duration_min, command.duration_max);
         }
+    } else {
+        command.type = CommandType::Unknown;
     }
+    return command;
 }
 
-void dungeon_run(int instance_id) {
-    std::stringstream thread_name_ss;
-    thread_name_ss << "DungeonRun-" << instance_id;
-    const std::string thread_name = thread_name_ss.str();
+namespace {
 
-    int time_in_dungeon = get_random_time();
-    log_message(thread_name, "Entering dungeon for " + std::to_string(time_in_dungeon) + "s.");
-    
-    std::this_thread::sleep_for(std::chrono::seconds(time_in_dungeon));
-    
-    {
-        std::lock_guard<std::mutex> lock(g_mutex);
-        instances[instance_id].status = "empty";
-        instances[instance_id].parties_served++;
-        instances[instance_id].total_time_served += time_in_dungeon;
-        active_parties--;
+std::string_view trim(std::string_view text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos) return {};
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
 
-        std::stringstream ss;
-        ss << "Instance " << instance_id << " is now free after " << time_in_dungeon << "s. "
-           << active_parties << " parties still active.";
-        log_message(thread_name, ss.str());
+template <typename T>
+bool parse_bounded(std::string_view value, T min_value, T max_value, std::optional<T>& target) {
+    T parsed;
+    if (!parse_number(value, parsed) || parsed < min_value || parsed > max_value) return false;
+    target = parsed;
+    return true;
+}
 
-        print_status(thread_name);
-    }
-    
-    cv.notify_all();
+bool parse_bool(std::string_view value, bool& target) {
+    if (value == "true" || value == "1" || value == "yes") target = true;
+    else if (value == "false" || value == "0" || value == "no") target = false;
+    else return false;
+    return true;
 }
 
-bool can_form_party() {
-    return tank_queue >= 1 && healer_queue >= 1 && dps_queue >= 3;
+// Drops a ';' or '#' comment that starts the line or follows whitespace, so
+// "scheduler = timer  ; one timer thread" keeps only "scheduler = timer".
+std::string_view strip_comment(std::string_view line) {
+    for (size_t i = 0; i < line.size(); ++i) {
+        if ((line[i] == ';' || line[i] == '#') && (i == 0 || line[i - 1] == ' ' || line[i - 1] == '\t')) {
+            return line.substr(0, i);
+        }
+    }
+    return line;
 }
 
-int find_free_instance() {
-    for (size_t i = 0; i < instances.size(); ++i) {
-        if (instances[i].status == "empty") {
-            return i;
+// "0:0.1, 8h:0.05, 20h:0.4, 24h:0.1": times in seconds or with an s/m/h/d
+// suffix, starting at 0 and never decreasing; rates in players per second.
+bool parse_rate_profile(std::string_view text, RateProfile& profile) {
+    RateProfile parsed;
+    while (!text.empty()) {
+        size_t comma = text.find(',');
+        std::string_view point = trim(text.substr(0, comma));
+        text = comma == std::string_view::npos ? std::string_view() : text.substr(comma + 1);
+        size_t colon = point.find(':');
+        if (colon == std::string_view::npos) return false;
+        std::string_view time = trim(point.substr(0, colon));
+        double unit = 1;
+        if (!time.empty() && std::string_view("smhd").find(time.back()) != std::string_view::npos) {
+            unit = time.back() == 'm' ? 60 : time.back() == 'h' ? 3600 : time.back() == 'd' ? 86400 : 1;
+            time.remove_suffix(1);
         }
+        double seconds = 0, rate = 0;
+        if (!parse_number(time, seconds) || !parse_number(trim(point.substr(colon + 1)), rate)) return false;
+        seconds *= unit;
+        if (rate < 0 || rate > 1e12 || seconds < 0 || (parsed.empty() ? seconds != 0 : seconds < parsed.period())) {
+            return false;
+        }
+        parsed.points.push_back({seconds, rate});
     }
-    return -1;
+    if (parsed.empty() || (parsed.points.size() > 1 && parsed.period() <= 0)) return false;
+    profile = std::move(parsed);
+    return true;
 }
 
-bool is_simulation_idle() {
-    return active_parties == 0 && !can_form_party();
+void print_usage(const char* program, std::ostream& out = std::cerr) {
+    out << "Usage: " << program << " [options]\n"
+        << "  --config <file.ini>           Load settings from an INI file (CLI flags override it)\n"
+        << "  --instances <n>               Max concurrent dungeon instances\n"
+        << "  --tanks/--healers/--dps <n>   Initial queue per role\n"
+        << "  --min-time/--max-time <s>     Dungeon run time bounds in seconds\n"
+        << "  --party <t,h,d>               Party template (default 1,1,3)\n"
+        << "  --queue-capacity <t,h,d>      Max queued players per role and region (0 = unbounded)\n"
+        << "  --admission-policy <name>     drop-newest | drop-oldest | delay (when a queue is full)\n"
+        << "  --batch-window <seconds>      Let formable parties wait up to this long to match in batches\n"
+        << "  --batch-size <n>              Close a batch early at n parties (default: free instances)\n"
+        << "  --staging <n>                 Match parties into a staging queue of n per region; a dispatcher\n"
+        << "                                thread moves them onto free instances (default 0: no staging)\n"
+        << "  --ready-check <seconds>       Hold each instance while members accept a ready check (0 = off)\n"
+        << "  --decline-rate <p>            Probability that a member declines the ready check\n"
+        << "  --response-time <seconds>     Mean time a member takes to answer (default 2)\n"
+        << "  --closed-population           Players re-queue after a cooldown instead of leaving\n"
+        << "  --cooldown <seconds>          Time between finishing a run and re-queueing (default 30)\n"
+        << "  --warmup <seconds>            Exclude this start-up period from the steady-state rates\n"
+        << "  --distribution <name>         uniform | exponential | normal\n"
+        << "  --log-level <name>            quiet | normal | verbose\n"
+        << "  --scheduler <name>            thread (one thread per run) | timer (one timer thread) |\n"
+        << "                                process (forked worker processes)\n"
+        << "  --workers <n>                 Worker processes for --scheduler process (default 2)\n"
+        << "  --instance-policy <name>      first-free | round-robin | lru | least-time | random\n"
+        << "  --seed <value>                Seed for dungeon run times\n"
+        << "  --control-socket <path>       Accept commands on a Unix domain socket\n"
+        << "  --shm-name </name>            Publish live state in a POSIX shared-memory segment\n"
+        << "  --shm-capacity <n>            Instance status slots per region in the segment\n"
+        << "  --shm-dump </name>            Print the state published in a segment and exit\n"
+        << "  --set <section.key=value>     Set any config file key\n"
+        << "  --summary-instances <k>       Final summary: auto | all | none | the k busiest and least used\n"
+        << "  --timeline <file>             Write a per-instance utilization heatmap (.pgm image, else CSV)\n"
+        << "  --timeline-buckets <n>        Heatmap columns across the run (default 60)\n"
+        << "  --event-log <file>            Journal every queue and instance event\n"
+        << "  --checkpoint-every <n>        Journal a state checkpoint every n events (default 10000)\n"
+        << "  --replay <file>               Fold a journal into the derived state, print it and exit\n"
+        << "  --replay-until <seconds>      Replay only events up to this time\n"
+        << "  --pin-former <cpus>           Pin party formers, one CPU each (e.g. 2 or 2,3)\n"
+        << "  --pin-workers <cpus>          Pin dungeon-run and timer threads to a CPU set (e.g. 4-7)\n"
+        << "  --former-policy <name>        default | other | fifo | rr (scheduling policy)\n"
+        << "  --former-priority <n>         Priority for fifo/rr (1-99) or nice value for other\n"
+        << "  --worker-policy/--worker-priority  The same for worker threads\n"
+        << "  --numa                        Home each region's threads and instances on a NUMA node\n"
+        << "  --numa-benchmark              Measure local vs cross-node instance updates and exit\n"
+        << "  --analyze                     Print an analytic capacity estimate and exit\n"
+        << "  --arrival-rate <t,h,d>        Arrival rates in players/second (for --analyze)\n"
+        << "  --cross-check <seconds>       Also run a virtual-time simulation of that length\n"
+        << "  --find-min-instances          Search the smallest n meeting --p99-target and exit\n"
+        << "  --p99-target <seconds>        Bottleneck-role p99 queue wait target for the search\n"
+        << "  --horizon <seconds>           Virtual time per simulated run (default 86400)\n"
+        << "  --replications <r>            Run r seeded virtual-time replications and report CIs\n"
+        << "  --confidence <level>          Confidence level for --replications (default 0.95)\n"
+        << "  --compare-instances <n2>      Also run n2 instances on the same seeds and report the paired difference\n"
+        << "  --flex-compare                Compare flex against single-role queueing in virtual time and exit\n"
+        << "  --flex-rate <players/s>       Flex player arrival rate for --flex-compare\n"
+        << "  --flex-roles <role[,role]>    Roles a flex player accepts (default tank,healer,dps)\n"
+        << "  --profile-tank/--profile-healer/--profile-dps <t:rate,...>\n"
+        << "                                Time-varying arrival rate curve, e.g. 0:0.1,18h:0.6,24h:0.1\n"
+        << "  --time-scale <x>              Profile seconds per real second in the live simulation (default 1)\n"
+        << "  --profile-report              Simulate the profiles in virtual time, report per bucket and exit\n"
+        << "  --profile-bucket <seconds>    Report row width for --profile-report (default 3600)\n"
+        << "  --threads <n>                 Parallel simulations (default: hardware concurrency)\n"
+        << "  --region <name:n[:t,h,d]>     Add a region with n instances and an initial queue (repeatable)\n"
+        << "  --overflow-after <seconds>    Borrow players from other regions after this wait (0 = never)\n"
+        << "  --cross-region-penalty <s>    Extra run time for a party formed across regions\n"
+        << "Settings not provided are prompted for interactively.\n";
 }
 
-void print_status(const std::string& thread_name) {
-    for (const auto& instance : instances) {
-        std::stringstream ss;
-        ss << "  Instance " << instance.id << ": " << instance.status;
-        log_message(thread_name, ss.str());
-    }
-}
\ No newline at end of file
+} // namespace
+
+// Keys are "section.key" as written in the INI file; CLI flags map onto them.
+bool apply_config_value(SimulationConfig& config, std::string_view key, std::string_view value, std::string& error) {
+    static const char* const role_keys[ROLE_COUNT] = {"tank", "healer", "dps"};
+    bool ok = true;
+
+    if (key == "simulation.instances") {
+        ok = parse_bounded(value, 1, max_instances, config.instances);
+    } else if (key == "simulation.seed") {
+        unsigned long long seed;
+        ok = parse_number(value, seed);
+        if (ok) config.seed = seed;
+    } else if (key == "simulation.scheduler") {
+        if (value == "thread") config.scheduler = RunScheduler::Thread;
+        else if (value == "timer") config.scheduler = RunScheduler::Timer;
+        else if (value == "process") config.scheduler = RunScheduler::Process;
+        else ok = false;
+    } else if (key == "simulation.workers") {
+        std::optional<int> count;
+        ok = parse_bounded(value, 1, 256, count);
+        if (ok) config.workers = *count;
+    } else if (key == "simulation.instance_policy") {
+        if (value == "first-free") config.instance_policy = InstancePolicy::FirstFree;
+        else if (value == "round-robin") config.instance_policy = InstancePolicy::RoundRobin;
+        else if (value == "lru") config.instance_policy = InstancePolicy::LeastRecentlyUsed;
+        else if (value == "least-time") config.instance_policy = InstancePolicy::LeastTotalTime;
+        else if (value == "random") config.instance_policy = InstancePolicy::Random;
+        else ok = false;
+    } else if (key == "duration.min") {
+        ok = parse_bounded(value, 0, max_run_seconds, config.min_time);
+    } else if (key == "duration.max") {
+        ok = parse_bounded(value, 0, max_run_seconds, config.max_time);
+    } else if (key == "duration.distribution") {
+        if (value == "uniform") config.distribution = DurationDistribution::Uniform;
+        else if (value == "exponential") config.distribution = DurationDistribution::Exponential;
+        else if (value == "normal") config.distribution = DurationDistribution::Normal;
+        else ok = false;
+    } else if (key == "logging.level") {
+        if (value == "quiet") config.log_level = LogLevel::Quiet;
+        else if (value == "normal") config.log_level = LogLevel::Normal;
+        else if (value == "verbose") config.log_level = LogLevel::Verbose;
+        else ok = false;
+    } else if (key == "control.socket") {
+        config.control_socket = std::string(value);
+    } else if (key == "shared_memory.name") {
+        config.shm_name = std::string(value);
+    } else if (key == "shared_memory.capacity") {
+        std::optional<int> capacity;
+        ok = parse_bounded(value, 1, max_instances, capacity);
+        if (ok) config.shm_capacity = *capacity;
+    } else if (key == "shared_memory.dump") {
+        config.shm_dump = std::string(value);
+    } else if (key == "summary.instances") {
+        std::optional<int> listed;
+        if (value == "auto") config.summary_instances = -1;
+        else if (value == "all") config.summary_instances = max_instances;
+        else if (value == "none") config.summary_instances = 0;
+        else if ((ok = parse_bounded(value, 1, max_instances, listed))) config.summary_instances = *listed;
+    } else if (key == "timeline.file") {
+        config.timeline = std::string(value);
+    } else if (key == "timeline.buckets") {
+        std::optional<int> buckets;
+        ok = parse_bounded(value, 1, 100000, buckets);
+        if (ok) config.timeline_buckets = *buckets;
+    } else if (key == "events.log") {
+        config.event_log = std::string(value);
+    } else if (key == "events.checkpoint_every") {
+        std::optional<int> count;
+        ok = parse_bounded(value, 0, std::numeric_limits<int>::max(), count);
+        if (ok) config.event_checkpoint_every = *count;
+    } else if (key == "events.replay") {
+        config.replay = std::string(value);
+    } else if (key == "events.replay_until") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e12, seconds);
+        if (ok) config.replay_until = seconds;
+    } else if (key.substr(0, 8) == "threads.") {
+        std::string_view field = key.substr(8);
+        ThreadPlacement* placement = nullptr;
+        if (field.substr(0, 7) == "former_") placement = &config.former_placement;
+        else if (field.substr(0, 7) == "worker_") placement = &config.worker_placement;
+        if (placement) field.remove_prefix(7);
+        if (placement && field == "cpus") {
+            ok = parse_cpu_list(value, placement->cpus) && !placement->cpus.empty();
+        } else if (placement && field == "policy") {
+            if (value == "default") placement->policy = SchedulingPolicy::Default;
+            else if (value == "other") placement->policy = SchedulingPolicy::Other;
+            else if (value == "fifo") placement->policy = SchedulingPolicy::Fifo;
+            else if (value == "rr") placement->policy = SchedulingPolicy::RoundRobin;
+            else ok = false;
+        } else if (placement && field == "priority") {
+            std::optional<int> priority;
+            ok = parse_bounded(value, -20, 99, priority);
+            if (ok) placement->priority = *priority;
+        } else {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+    } else if (key == "numa.enabled") {
+        ok = parse_bool(value, config.numa);
+    } else if (key == "numa.benchmark") {
+        ok = parse_bool(value, config.numa_benchmark);
+    } else if (key == "analysis.enabled") {
+        ok = parse_bool(value, config.analyze);
+    } else if (key == "analysis.flex_compare") {
+        ok = parse_bool(value, config.flex_compare);
+    } else if (key == "arrivals.flex") {
+        std::optional<double> rate;
+        ok = parse_bounded(value, 0.0, 1e12, rate);
+        if (ok) config.flex_rate = *rate;
+    } else if (key == "arrivals.flex_roles") {
+        int mask = parse_role_mask(value);
+        ok = mask != 0;
+        if (ok) config.flex_roles = mask;
+    } else if (key == "analysis.cross_check") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.cross_check_seconds = *seconds;
+    } else if (key == "search.enabled") {
+        ok = parse_bool(value, config.find_min_instances);
+    } else if (key == "search.p99_target") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.p99_target = *seconds;
+    } else if (key == "search.horizon") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 1.0, 1e9, seconds);
+        if (ok) config.search_horizon = *seconds;
+    } else if (key == "search.threads") {
+        std::optional<int> threads;
+        ok = parse_bounded(value, 0, 1024, threads);
+        if (ok) config.search_threads = *threads;
+    } else if (key == "montecarlo.replications") {
+        std::optional<int> replications;
+        ok = parse_bounded(value, 2, 1000000, replications);
+        if (ok) config.replications = *replications;
+    } else if (key == "montecarlo.confidence") {
+        std::optional<double> level;
+        ok = parse_bounded(value, 0.5, 0.9999, level);
+        if (ok) config.confidence = *level;
+    } else if (key == "montecarlo.compare_instances") {
+        ok = parse_bounded(value, 1, max_instances, config.compare_instances);
+    } else if (key == "limits.policy") {
+        if (value == "drop-newest") config.admission_policy = AdmissionPolicy::DropNewest;
+        else if (value == "drop-oldest") config.admission_policy = AdmissionPolicy::DropOldest;
+        else if (value == "delay") config.admission_policy = AdmissionPolicy::Delay;
+        else ok = false;
+    } else if (key.substr(0, 7) == "limits.") {
+        int role = parse_role(key.substr(7));
+        if (role < 0 || key.substr(7) != role_keys[role]) {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+        std::optional<long long> capacity;
+        ok = parse_bounded(value, 0LL, max_queue_size, capacity);
+        if (ok) config.queue_capacity[role] = *capacity;
+    } else if (key == "matching.window") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.batch_window = *seconds;
+    } else if (key == "matching.max_batch") {
+        std::optional<int> parties;
+        ok = parse_bounded(value, 0, 1000000, parties);
+        if (ok) config.batch_max_parties = *parties;
+    } else if (key == "matching.staging") {
+        std::optional<int> parties;
+        ok = parse_bounded(value, 0, 1000000, parties);
+        if (ok) config.staging_capacity = *parties;
+    } else if (key == "population.closed") {
+        ok = parse_bool(value, config.closed_population);
+    } else if (key == "population.cooldown") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.population_cooldown = *seconds;
+    } else if (key == "population.warmup") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.population_warmup = *seconds;
+    } else if (key == "ready_check.timeout") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 86400.0, seconds);
+        if (ok) config.ready_check_timeout = *seconds;
+    } else if (key == "ready_check.decline") {
+        std::optional<double> probability;
+        ok = parse_bounded(value, 0.0, 1.0, probability);
+        if (ok) config.ready_check_decline = *probability;
+    } else if (key == "ready_check.response") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.001, 86400.0, seconds);
+        if (ok) config.ready_check_response = *seconds;
+    } else if (key == "regions.overflow_after") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 0.0, 1e9, seconds);
+        if (ok) config.overflow_after = *seconds;
+    } else if (key == "regions.cross_region_penalty") {
+        std::optional<int> seconds;
+        ok = parse_bounded(value, 0, max_run_seconds, seconds);
+        if (ok) config.cross_region_penalty = *seconds;
+    } else if (key.substr(0, 7) == "region.") {
+        // region.<name>.<field>, i.e. a [region.<name>] section
+        size_t dot = key.rfind('.');
+        std::string_view name = key.substr(7, dot > 7 ? dot - 7 : 0);
+        std::string_view field = key.substr(dot + 1);
+        int role = parse_role(field);
+        if (name.empty() || name.find_first_of(" \t") != std::string_view::npos
+            || (field != "instances" && (role < 0 || field != role_keys[role]))) {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+        auto region = std::find_if(config.regions.begin(), config.regions.end(),
+                                   [name](const auto& entry) { return entry.name == name; });
+        if (region == config.regions.end()) {
+            config.regions.push_back({std::string(name), {}, {}});
+            region = config.regions.end() - 1;
+        }
+        if (role < 0) ok = parse_bounded(value, 1, max_instances, region->instances);
+        else ok = parse_bounded(value, 0LL, max_queue_size, region->queue[role]);
+    } else if (key == "analysis.profile_report") {
+        ok = parse_bool(value, config.profile_report);
+    } else if (key == "profile.time_scale") {
+        std::optional<double> scale;
+        ok = parse_bounded(value, 1e-6, 1e9, scale);
+        if (ok) config.profile_time_scale = *scale;
+    } else if (key == "profile.bucket") {
+        std::optional<double> seconds;
+        ok = parse_bounded(value, 1.0, 1e9, seconds);
+        if (ok) config.profile_bucket = *seconds;
+    } else if (key.substr(0, 8) == "profile.") {
+        int role = parse_role(key.substr(8));
+        if (role < 0 || key.substr(8) != role_keys[role]) {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+        ok = parse_rate_profile(value, config.arrival_profile[role]);
+    } else if (key.substr(0, 9) == "arrivals.") {
+        int role = parse_role(key.substr(9));
+        if (role < 0 || key.substr(9) != role_keys[role]) {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+        std::optional<double> rate;
+        ok = parse_bounded(value, 0.0, 1e12, rate);
+        if (ok) config.arrival_rate[role] = *rate;
+    } else if (key.substr(0, 6) == "queue." || key.substr(0, 6) == "party.") {
+        int role = parse_role(key.substr(6));
+        if (role < 0 || key.substr(6) != role_keys[role]) {
+            error = "unknown key '" + std::string(key) + "'";
+            return false;
+        }
+        if (key[0] == 'q') {
+            ok = parse_bounded(value, 0LL, max_queue_size, config.queue[role]);
+        } else {
+            std::optional<int> size;
+            ok = parse_bounded(value, 0, max_party_role_size, size);
+            if (ok) config.party[role] = *size;
+        }
+    } else {
+        error = "unknown key '" + std::string(key) + "'";
+        return false;
+    }
+
+    if (!ok) error = "invalid value '" + std::string(value) + "' for " + std::string(key);
+    return ok;
+}
+
+bool load_config_file(const std::string& path, SimulationConfig& config) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "Could not open config file '" << path << "'.\n";
+        return false;
+    }
+
+    std::string line, section;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        std::string_view text = trim(strip_comment(line));
+        if (text.empty()) continue;
+
+        if (text.front() == '[' && text.back() == ']') {
+            section = std::string(trim(text.substr(1, text.size() - 2)));
+            continue;
+        }
+
+        size_t equals = text.find('=');
+        std::string error;
+        if (equals == std::string_view::npos) {
+            error = "expected key = value";
+        } else {
+            std::string key = section + "." + std::string(trim(text.substr(0, equals)));
+            apply_config_value(config, key, trim(text.substr(equals + 1)), error);
+        }
+        if (!error.empty()) {
+            std::cerr << path << ":" << line_number << ": " << error << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool parse_command_line(int argc, char* argv[], SimulationConfig& config) {
+    static const std::pair<std::string_view, std::string_view> flag_keys[] = {
+        {"--instances", "simulation.instances"}, {"--seed", "simulation.seed"},
+        {"--scheduler", "simulation.scheduler"}, {"--instance-policy", "simulation.instance_policy"},
+        {"--workers", "simulation.workers"}, {"--admission-policy", "limits.policy"},
+        {"--pin-former", "threads.former_cpus"}, {"--former-policy", "threads.former_policy"},
+        {"--former-priority", "threads.former_priority"}, {"--pin-workers", "threads.worker_cpus"},
+        {"--worker-policy", "threads.worker_policy"}, {"--worker-priority", "threads.worker_priority"},
+        {"--tanks", "queue.tank"},
+        {"--healers", "queue.healer"}, {"--dps", "queue.dps"},
+        {"--min-time", "duration.min"}, {"--max-time", "duration.max"},
+        {"--distribution", "duration.distribution"}, {"--log-level", "logging.level"},
+        {"--control-socket", "control.socket"}, {"--cross-check", "analysis.cross_check"},
+        {"--shm-name", "shared_memory.name"}, {"--shm-capacity", "shared_memory.capacity"},
+        {"--shm-dump", "shared_memory.dump"},
+        {"--p99-target", "search.p99_target"}, {"--horizon", "search.horizon"},
+        {"--threads", "search.threads"}, {"--replications", "montecarlo.replications"},
+        {"--confidence", "montecarlo.confidence"}, {"--compare-instances", "montecarlo.compare_instances"},
+        {"--summary-instances", "summary.instances"}, {"--timeline", "timeline.file"},
+        {"--timeline-buckets", "timeline.buckets"}, {"--event-log", "events.log"}, {"--checkpoint-every", "events.checkpoint_every"},
+        {"--replay", "events.replay"}, {"--replay-until", "events.replay_until"},
+        {"--flex-rate", "arrivals.flex"}, {"--flex-roles", "arrivals.flex_roles"},
+        {"--batch-window", "matching.window"}, {"--batch-size", "matching.max_batch"}, {"--staging", "matching.staging"},
+        {"--ready-check", "ready_check.timeout"}, {"--decline-rate", "ready_check.decline"},
+        {"--response-time", "ready_check.response"}, {"--cooldown", "population.cooldown"},
+        {"--warmup", "population.warmup"}, {"--profile-tank", "profile.tank"},
+        {"--profile-healer", "profile.healer"}, {"--profile-dps", "profile.dps"},
+        {"--time-scale", "profile.time_scale"}, {"--profile-bucket", "profile.bucket"},
+        {"--overflow-after", "regions.overflow_after"}, {"--cross-region-penalty", "regions.cross_region_penalty"},
+    };
+    static const std::pair<std::string_view, std::string_view> switch_keys[] = {
+        {"--analyze", "analysis.enabled"}, {"--find-min-instances", "search.enabled"},
+        {"--flex-compare", "analysis.flex_compare"}, {"--closed-population", "population.closed"},
+        {"--profile-report", "analysis.profile_report"},
+        {"--numa", "numa.enabled"}, {"--numa-benchmark", "numa.benchmark"},
+    };
+    static const std::pair<std::string_view, std::string_view> role_list_keys[] = {
+        {"--party", "party."}, {"--arrival-rate", "arrivals."}, {"--queue-capacity", "limits."},
+    };
+    static const char* const role_keys[ROLE_COUNT] = {"tank", "healer", "dps"};
+    auto find_flag = [](const auto& table, std::string_view flag) {
+        auto match = std::find_if(std::begin(table), std::end(table),
+                                  [flag](const auto& entry) { return entry.first == flag; });
+        return match == std::end(table) ? nullptr : &*match;
+    };
+
+    // The config file is loaded first wherever it appears so flags override it.
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (std::string_view(argv[i]) == "--config" && !load_config_file(argv[i + 1], config)) return false;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view flag = argv[i];
+        std::string error;
+
+        if (auto match = find_flag(switch_keys, flag)) {
+            apply_config_value(config, match->second, "true", error);
+        } else if (flag == "--help" || flag == "-h") {
+            print_usage(argv[0], std::cout);
+            config.show_help = true;
+            return true;
+        } else if (i + 1 >= argc) {
+            bool takes_value = find_flag(flag_keys, flag) || find_flag(role_list_keys, flag) || flag == "--config" ||
+                               flag == "--set" || flag == "--region";
+            error = takes_value ? "missing value for '" + std::string(flag) + "'"
+                                : "unknown option '" + std::string(flag) + "'";
+        } else if (std::string_view value = argv[++i]; flag == "--config") {
+            continue;
+        } else if (flag == "--set") {
+            size_t equals = value.find('=');
+            if (equals == std::string_view::npos) error = "expected --set section.key=value";
+            else apply_config_value(config, trim(value.substr(0, equals)), trim(value.substr(equals + 1)), error);
+        } else if (flag == "--region") {
+            size_t colon = value.find(':');
+            if (colon == std::string_view::npos) {
+                error = "expected --region name:instances[:t,h,d]";
+            } else {
+                std::string prefix = "region." + std::string(value.substr(0, colon)) + ".";
+                std::string_view rest = value.substr(colon + 1);
+                size_t queue_colon = rest.find(':');
+                apply_config_value(config, prefix + "instances", rest.substr(0, queue_colon), error);
+                rest = queue_colon == std::string_view::npos ? std::string_view() : rest.substr(queue_colon + 1);
+                for (int role = 0; role < ROLE_COUNT && error.empty() && !rest.empty(); ++role) {
+                    size_t comma = rest.find(',');
+                    apply_config_value(config, prefix + role_keys[role], rest.substr(0, comma), error);
+                    rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+                }
+            }
+        } else if (auto list = find_flag(role_list_keys, flag)) {
+            std::string_view rest = value;
+            for (int role = 0; role < ROLE_COUNT && error.empty(); ++role) {
+                size_t comma = rest.find(',');
+                apply_config_value(config, std::string(list->second) + role_keys[role], rest.substr(0, comma), error);
+                rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+            }
+        } else if (auto keyed = find_flag(flag_keys, flag)) {
+            apply_config_value(config, keyed->second, value, error);
+        } else {
+            error = "unknown option '" + std::string(flag) + "'";
+        }
+
+        if (!error.empty()) {
+            std::cerr << argv[0] << ": " << error << "\n";
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if (config.party[ROLE_TANK] + config.party[ROLE_HEALER] + config.party[ROLE_DPS] == 0) {
+        std::cerr << argv[0] << ": party template must contain at least one player\n";
+        return false;
+    }
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (config.queue_capacity[role] != 0 && config.queue_capacity[role] < config.party[role]) {
+            std::cerr << argv[0] << ": " << role_names[role] << " queue capacity is smaller than the party needs\n";
+            return false;
+        }
+    }
+    for (const auto& region : config.regions) {
+        if (!region.instances) {
+            std::cerr << argv[0] << ": region '" << region.name << "' needs an instance count\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads one startup value. At a terminal the prompt repeats until the value is
+// valid; from a pipe the first invalid value aborts startup instead of letting
+// later answers shift into the wrong parameters.
+template <typename T>
+bool prompt_value(const char* prompt, T min_value, T max_value, T& target) {
+    std::string token;
+    while (true) {
+        std::cout << prompt;
+        if (!(std::cin >> token)) {
+            std::cerr << "\nUnexpected end of input.\n";
+            return false;
+        }
+        if (parse_number(token, target) && target >= min_value && target <= max_value) return true;
+
+        std::cerr << "Invalid value '" << token << "': expected an integer from " << min_value << " to "
+                  << max_value << ".\n";
+        if (!stdin_is_terminal()) return false;
+    }
+}
+
+// Handles every command except add, whose batching differs between the
+// interactive and piped front ends.
+void execute_command(const std::string& thread_name, const Command& command) {
+    switch (command.type) {
+    case CommandType::Quit:
+        request_shutdown();
+        break;
+    case CommandType::Invalid:
+        log_message(thread_name, command.error);
+        break;
+    case CommandType::Unknown:
+        log_message(thread_name, "Unknown command: '" + std::string(command.word) + "'");
+        break;
+    case CommandType::Status:
+        log_message(thread_name, describe_status(snapshot_after_controls()));
+        break;
+    case CommandType::Stats:
+        log_message(thread_name, describe_stats(snapshot_after_controls()));
+        break;
+    case CommandType::Add:
+    case CommandType::None:
+        break;
+    default:
+        post_control(to_control(command));
+        break;
+    }
+}
+
+ControlCommand to_control(const Command& command) {
+    ControlCommand control;
+    control.type = command.type;
+    if (command.type == CommandType::Add) control.amounts[command.role] = command.amount;
+    control.region = command.region;
+    control.value = command.amount;
+    if (command.type == CommandType::AddFlex) {
+        control.amounts[0] = command.amount;
+        control.value = command.role;
+    }
+    control.duration_min = command.duration_min;
+    control.duration_max = command.duration_max;
+    control.seed = command.seed;
+    return control;
+}
+
+// Waits until every control command posted so far is reflected in the
+// snapshot, so a query issued after `scale` or `add` sees its effect.
+SimulationSnapshot snapshot_after_controls() {
+    unsigned long long posted;
+    {
+        std::lock_guard<std::mutex> lock(control_mutex);
+        posted = control_seq;
+    }
+    return wait_for_snapshot([posted](const SimulationSnapshot& snapshot) {
+        return snapshot.applied_control_seq >= posted;
+    });
+}
+
+// "Matching window 2.00s: 12 batches, 3.50 parties/batch, formation delay
+// 1.20s mean/2.00s max, rating spread 310.4, queue wait 8.31s" -- what a
+// window costs in latency against what it buys in match quality. Only shown
+// with a window: immediate matching has nothing to trade off.
+std::string describe_matching(const SimulationSnapshot& snapshot) {
+    long long batches = 0, parties = 0, matched = 0;
+    double delay = 0, max_delay = 0, spread = 0, wait = 0;
+    for (const auto& region : snapshot.regions) {
+        batches += region.batches;
+        parties += region.batched_parties;
+        delay += region.total_formation_delay;
+        max_delay = std::max(max_delay, region.max_formation_delay);
+        spread += region.total_rating_spread;
+        matched += region.players_matched;
+        wait += region.total_wait_seconds;
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Matching window " << batch_window << "s: " << batches << " batches, " << (batches ? double(parties) / batches : 0.0) << " parties/batch, formation delay "
+       << (parties ? delay / parties : 0.0) << "s mean/" << max_delay << "s max, rating spread " << std::setprecision(1)
+       << (parties ? spread / parties : 0.0) << std::setprecision(2) << ", queue wait " << (matched ? wait / matched : 0.0)
+       << "s";
+    return ss.str();
+}
+
+// Empty until a flex player has been queued, e.g. "Flex 4 queued, 12 matched
+// (5T/0H/7D), 9 parties needed one".
+std::string describe_flex(const SimulationSnapshot& snapshot) {
+    long long queued = 0, matched[ROLE_COUNT] = {0, 0, 0}, parties = 0;
+    for (const auto& region : snapshot.regions) {
+        queued = saturating_add(queued, region.flex_queued);
+        for (int role = 0; role < ROLE_COUNT; ++role) matched[role] += region.flex_matched[role];
+        parties += region.flex_parties;
+    }
+    if (queued == 0 && parties == 0) return "";
+    std::stringstream ss;
+    ss << "Flex " << queued << " queued, " << matched[ROLE_TANK] + matched[ROLE_HEALER] + matched[ROLE_DPS]
+       << " matched (" << matched[ROLE_TANK] << "T/" << matched[ROLE_HEALER] << "H/" << matched[ROLE_DPS] << "D), "
+       << parties << " parties needed one";
+    return ss.str();
+}
+
+// Only with staging, e.g. "Staging 3 staged of 8 (peak 8), 120 dispatched,
+// dispatch wait 1.20s mean/5.00s max, 4 passes stalled on a full stage".
+std::string describe_staging(const SimulationSnapshot& snapshot) {
+    long long staged = 0, peak = 0, dispatched = 0, stalls = 0;
+    double wait = 0, max_wait = 0;
+    for (const auto& region : snapshot.regions) {
+        staged += region.staged;
+        peak = std::max(peak, region.staged_peak);
+        dispatched += region.parties_dispatched;
+        wait += region.total_dispatch_wait;
+        max_wait = std::max(max_wait, region.max_dispatch_wait);
+        stalls += region.stage_full_stalls;
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Staging " << staged << " staged of " << staging_capacity
+       << (snapshot.regions.size() > 1 ? " per region" : "") << " (peak " << peak << "), " << dispatched
+       << " dispatched, dispatch wait " << (dispatched ? wait / dispatched : 0.0) << "s mean/" << max_wait << "s max, "
+       << stalls << " passes stalled on a full stage";
+    return ss.str();
+}
+
+// Only with ready checks, e.g. "Ready checks 120 (18 failed: 11 declined, 7
+// timed out), 71 players returned to the front, 20 left, instances held
+// 145.20s in checks (31.50s in failed ones), churn 15.0%".
+std::string describe_ready_checks(const SimulationSnapshot& snapshot) {
+    long long checks = 0, declined = 0, timed_out = 0, returned = 0, dropped = 0;
+    double held = 0, wasted = 0;
+    for (const auto& region : snapshot.regions) {
+        checks += region.ready_checks;
+        declined += region.ready_checks_declined;
+        timed_out += region.ready_checks_timed_out;
+        returned += region.players_returned;
+        dropped += region.players_dropped;
+        held += region.ready_check_seconds;
+        wasted += region.failed_check_seconds;
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Ready checks " << checks << " (" << declined + timed_out
+       << " failed: " << declined << " declined, " << timed_out << " timed out), " << returned
+       << " players returned to the front, " << dropped << " left, instances held " << held << "s in checks ("
+       << wasted << "s in failed ones), churn " << std::setprecision(1)
+       << (checks ? 100.0 * (declined + timed_out) / checks : 0.0) << "%";
+    return ss.str();
+}
+
+// Only with a closed population, e.g. "Population 150: 30 queued, 100 in
+// parties, 20 cooling down, 412 returns | Steady state since 60.0s: 11.52
+// parties/min, mean wait 8.21s".
+std::string describe_population(const SimulationSnapshot& snapshot) {
+    long long queued = 0, served = 0, matched = 0;
+    double wait = 0;
+    for (const auto& region : snapshot.regions) {
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            queued = saturating_add(queued, region.queue[role]);
+            queued = saturating_add(queued, region.backlog[role]);
+        }
+        queued = saturating_add(queued, region.flex_queued);
+        served += region.parties_served;
+        matched += region.players_matched;
+        wait += region.total_wait_seconds;
+    }
+    long long party_size = party_template[ROLE_TANK] + party_template[ROLE_HEALER] + party_template[ROLE_DPS];
+    long long in_parties = (snapshot.active_parties + snapshot.staged_parties) * party_size;
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Population "
+       << saturating_add(saturating_add(queued, in_parties), snapshot.players_cooling_down) << ": " << queued
+       << " queued, " << in_parties << " in parties, " << snapshot.players_cooling_down << " cooling down, "
+       << snapshot.population_returns << " returns | ";
+    const PopulationBaseline& baseline = snapshot.population_baseline;
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    if (!baseline.taken || uptime <= baseline.at) {
+        ss << "Warming up until " << std::setprecision(1) << population_warmup << "s";
+        return ss.str();
+    }
+    long long steady_matched = matched - baseline.players_matched;
+    ss << "Steady state since " << std::setprecision(1) << baseline.at << "s: " << std::setprecision(2)
+       << 60.0 * (served - baseline.parties_served) / (uptime - baseline.at) << " parties/min, mean wait "
+       << (steady_matched > 0 ? (wait - baseline.total_wait_seconds) / steady_matched : 0.0) << "s";
+    return ss.str();
+}
+
+// Where the live run is on the curve, e.g. "Profile at 18:30 (x60): 0.412T,
+// 0.431H, 1.290D per second".
+std::string describe_profile() {
+    static const char role_letters[ROLE_COUNT] = {'T', 'H', 'D'};
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    double t = uptime * profile_time_scale;
+    long long seconds = static_cast<long long>(t);
+    std::stringstream ss;
+    ss << "Profile at " << seconds / 3600 << ":" << std::setw(2) << std::setfill('0') << seconds / 60 % 60
+       << std::setfill(' ') << " (x" << profile_time_scale << "):" << std::fixed << std::setprecision(3);
+    const char* separator = " ";
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (arrival_profiles[role].empty()) continue;
+        ss << separator << profile_rate(arrival_profiles[role], t) << role_letters[role];
+        separator = ", ";
+    }
+    ss << " per second";
+    return ss.str();
+}
+
+bool queues_bounded() {
+    return std::any_of(std::begin(queue_capacity), std::end(queue_capacity), [](long long c) { return c > 0; });
+}
+
+const char* admission_policy_name(AdmissionPolicy policy) {
+    switch (policy) {
+    case AdmissionPolicy::DropOldest: return "drop-oldest";
+    case AdmissionPolicy::Delay: return "delay";
+    default: return "drop-newest";
+    }
+}
+
+// Backpressure totals across regions, e.g. "Backpressure drop-oldest, capacity
+// 2T/2H/6D: 0 rejected, 14 evicted, 0 held".
+std::string describe_backpressure(const SimulationSnapshot& snapshot) {
+    long long rejected = 0, evicted = 0, held = 0, delayed = 0, admitted = 0;
+    double delay = 0;
+    for (const auto& region : snapshot.regions) {
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            rejected = saturating_add(rejected, region.rejected[role]);
+            evicted = saturating_add(evicted, region.evicted[role]);
+            held = saturating_add(held, region.backlog[role]);
+        }
+        delayed = saturating_add(delayed, region.players_delayed);
+        admitted = saturating_add(admitted, region.admitted_from_backlog);
+        delay += region.total_admission_delay;
+    }
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "Backpressure " << admission_policy_name(admission_policy)
+       << ", capacity " << queue_capacity[ROLE_TANK] << "T/" << queue_capacity[ROLE_HEALER] << "H/"
+       << queue_capacity[ROLE_DPS] << "D: " << rejected << " rejected, " << evicted << " evicted, " << held
+       << " held";
+    if (admission_policy == AdmissionPolicy::Delay) {
+        ss << " (" << delayed << " delayed, avg admission delay " << (admitted ? delay / admitted : 0.0) << "s)";
+    }
+    return ss.str();
+}
+
+std::string describe_status(const SimulationSnapshot& snapshot) {
+    std::stringstream ss;
+    ss << "Status: Queue " << snapshot.tanks << "T, " << snapshot.healers << "H, " << snapshot.dps << "D"
+       << " | Instances " << snapshot.active_parties << " active, " << snapshot.free_instances << " free of "
+       << snapshot.instance_limit
+       << " | Formation " << (snapshot.paused ? "paused" : "running")
+       << " | Admission " << (snapshot.draining ? "draining" : "open")
+       << " | Duration " << snapshot.min_time << "-" << snapshot.max_time << "s";
+    if (queues_bounded()) ss << " | " << describe_backpressure(snapshot);
+    std::string flex = describe_flex(snapshot);
+    if (!flex.empty()) ss << " | " << flex;
+    if (staging_capacity > 0) ss << " | " << describe_staging(snapshot);
+    if (snapshot.regions.size() > 1) {
+        for (const auto& region : snapshot.regions) {
+            ss << " | " << region.name << ": " << region.queue[ROLE_TANK] << "T, " << region.queue[ROLE_HEALER] << "H, "
+               << region.queue[ROLE_DPS] << "D, " << region.active_parties << " active, " << region.free_instances
+               << " free of " << region.instance_limit;
+            if (staging_capacity > 0) ss << ", " << region.staged << " staged";
+        }
+    }
+    return ss.str();
+}
+
+std::string describe_stats(const SimulationSnapshot& snapshot) {
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    double capacity = uptime * snapshot.instance_limit;
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << "Stats: " << snapshot.parties_formed << " parties formed, " << snapshot.parties_served
+       << " served, " << snapshot.total_time_served << "s total run time, "
+       << snapshot.players_rejected << " players rejected"
+       << " | Avg run " << (snapshot.parties_served ? double(snapshot.total_time_served) / snapshot.parties_served : 0.0) << "s"
+       << " | Utilization " << (capacity > 0 ? 100.0 * snapshot.total_time_served / capacity : 0.0) << "%"
+       << " | Throughput " << (uptime > 0 ? 60.0 * snapshot.parties_served / uptime : 0.0) << " parties/min"
+       << " | Former wake " << std::setprecision(3)
+       << (snapshot.former_wakeups ? 1000.0 * snapshot.former_wake_latency_total / snapshot.former_wakeups : 0.0)
+       << "ms mean, " << 1000.0 * snapshot.former_wake_latency_max << "ms max" << std::setprecision(2)
+       << " | Heap " << snapshot.heap_allocations << " allocations ("
+       << (snapshot.parties_formed ? double(snapshot.heap_allocations) / snapshot.parties_formed : 0.0)
+       << "/party), " << snapshot.records_in_use << " party records in " << snapshot.record_slabs << " slab(s)"
+       << " | Events " << snapshot.events_recorded << " recorded, " << snapshot.events_folded << " folded";
+    if (batch_window > 0) ss << " | " << describe_matching(snapshot);
+    if (queues_bounded()) ss << " | " << describe_backpressure(snapshot);
+    std::string flex = describe_flex(snapshot);
+    if (!flex.empty()) ss << " | " << flex;
+    if (staging_capacity > 0) ss << " | " << describe_staging(snapshot);
+    if (ready_check_timeout > 0) ss << " | " << describe_ready_checks(snapshot);
+    if (closed_population) ss << " | " << describe_population(snapshot);
+    if (profiled_arrivals()) ss << " | " << describe_profile();
+    if (snapshot.regions.size() > 1) {
+        for (const auto& region : snapshot.regions) {
+            ss << " | " << region.name << ": " << region.parties_formed << " formed (" << region.cross_region_parties
+               << " cross-region), " << region.parties_served << " served, "
+               << (uptime > 0 ? 60.0 * region.parties_served / uptime : 0.0) << " parties/min, avg wait "
+               << (region.players_matched ? region.total_wait_seconds / region.players_matched : 0.0) << "s";
+        }
+    }
+    if (snapshot.coordinated) {
+        const CoordinationStats& c = snapshot.coordination;
+        ss << " | Coordination " << c.assignments << " assignments/" << c.assignment_batches << " batches, "
+           << c.completions << " completions/" << c.completion_batches << " batches, overhead "
+           << (c.completions ? 1000.0 * c.overhead_seconds / c.completions : 0.0) << "ms mean";
+    }
+    return ss.str();
+}
+
+void request_shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(shutdown_mutex);
+        simulation_running = false;
+    }
+    shutdown_cv.notify_all();
+    { std::lock_guard<std::mutex> lock(g_mutex); }
+    cv.notify_all();
+    { std::lock_guard<std::mutex> lock(snapshot_mutex); }
+    snapshot_cv.notify_all();
+#ifndef _WIN32
+    if (shutdown_pipe[1] >= 0) {
+        char byte = 0;
+        ssize_t ignored = write(shutdown_pipe[1], &byte, 1);
+        (void)ignored;
+    }
+#endif
+}
+
+void apply_adds(const std::string& thread_name, int region_index, const long long (&amounts)[ROLE_COUNT],
+                const std::string& message) {
+    ControlCommand control;
+    control.type = CommandType::Add;
+    control.region = region_index;
+    std::copy(std::begin(amounts), std::end(amounts), control.amounts);
+
+    log_message(thread_name, message);
+    unsigned long long seq = post_control(control);
+
+    wait_for_snapshot([seq](const SimulationSnapshot& snapshot) {
+        return snapshot.applied_control_seq >= seq && (snapshot.idle || open_ended_run());
+    });
+    log_message(thread_name, "Processing complete. Ready for next command.");
+}
+
+unsigned long long post_control(ControlCommand command) {
+    {
+        std::lock_guard<std::mutex> lock(control_mutex);
+        command.seq = ++control_seq;
+        control_queue.push_back(command);
+        control_pending = true;
+    }
+    // The empty critical section orders the flag against the former's predicate
+    // check, so this notify cannot fall between its check and its wait.
+    { std::lock_guard<std::mutex> lock(g_mutex); }
+    note_wake_request();
+    cv.notify_all();
+    return command.seq;
+}
+
+// Called by a party former with g_mutex held. Commands for any region are
+// applied by whichever former wakes first; the others are woken afterwards.
+void apply_control_commands(const std::string& thread_name) {
+    std::vector<ControlCommand> pending;
+    {
+        std::lock_guard<std::mutex> lock(control_mutex);
+        pending.swap(control_queue);
+        control_pending = false;
+    }
+    if (pending.empty()) return;
+    auto now = std::chrono::steady_clock::now();
+
+    for (const auto& control : pending) {
+        std::stringstream ss;
+        Region& region = regions[control.region];
+        switch (control.type) {
+        case CommandType::Add: {
+            if (admission_closed) {
+                ss << "Draining: rejected " << control.amounts[ROLE_TANK] << "T, " << control.amounts[ROLE_HEALER]
+                   << "H, " << control.amounts[ROLE_DPS] << "D.";
+                for (long long amount : control.amounts) players_rejected = saturating_add(players_rejected, amount);
+                break;
+            }
+            for (int role = 0; role < ROLE_COUNT; ++role) admit_players(region, role, control.amounts[role], now, ss);
+            break;
+        }
+        case CommandType::AddFlex:
+            if (admission_closed) {
+                ss << "Draining: rejected " << control.amounts[0] << " flex player(s).";
+                players_rejected = saturating_add(players_rejected, control.amounts[0]);
+                break;
+            }
+            enqueue_flex_players(region, control.value, control.amounts[0], now);
+            ss << "Queued " << control.amounts[0] << " flex " << role_mask_name(control.value) << " player(s)"
+               << (regions.size() > 1 ? " in " + region.name : "") << ".";
+            break;
+        case CommandType::Scale:
+            resize_instance_pool(region, control.value);
+            ss << "Scaled " << (regions.size() > 1 ? region.name + " " : "") << "to " << region.instance_limit
+               << " instance(s).";
+            break;
+        case CommandType::Pause:
+            formation_paused = true;
+            ss << "Party formation paused.";
+            break;
+        case CommandType::Resume:
+            formation_paused = false;
+            admission_closed = false;
+            ss << "Party formation resumed. Admission open.";
+            break;
+        case CommandType::Drain:
+            admission_closed = true;
+            ss << "Draining: new players are rejected; queued players are still matched.";
+            break;
+        case CommandType::Seed: {
+            std::lock_guard<std::mutex> lock(rng_mutex);
+            rng.seed(static_cast<std::mt19937::result_type>(control.seed));
+            ss << "RNG seeded with " << control.seed << ".";
+            break;
+        }
+        case CommandType::SetDuration: {
+            std::lock_guard<std::mutex> lock(rng_mutex);
+            min_time = control.duration_min;
+            max_time = control.duration_max;
+            ss << "Dungeon duration set to " << min_time << "-" << max_time << "s.";
+            break;
+        }
+        default:
+            break;
+        }
+        applied_control_seq = control.seq;
+        if (ss.tellp() > 0) log_message(thread_name, ss.str());
+    }
+    cv.notify_all();
+}
+
+// Called with g_mutex held by whichever thread just changed the state. The
+// snapshot is built in a staging buffer that is swapped with the published
+// one, so both keep their region storage and publishing does not allocate.
+void publish_snapshot() {
+    static SimulationSnapshot staging;  // guarded by g_mutex
+    std::vector<RegionSnapshot> region_storage = std::move(staging.regions);
+    staging = SimulationSnapshot{};
+    staging.regions = std::move(region_storage);
+    staging.regions.resize(regions.size());
+    SimulationSnapshot& snapshot = staging;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        const Region& region = regions[i];
+        RegionSnapshot& entry = snapshot.regions[i];
+        entry.name = region.name;
+        std::copy(std::begin(region.queue), std::end(region.queue), entry.queue);
+        entry.active_parties = region.active_parties;
+        entry.instance_limit = region.instance_limit;
+        entry.free_instances = region.free_instance_count;
+        entry.parties_formed = region.parties_formed;
+        entry.cross_region_parties = region.cross_region_parties;
+        entry.parties_served = region.parties_served;
+        entry.total_time_served = region.total_time_served;
+        entry.players_matched = region.players_matched;
+        entry.total_wait_seconds = region.total_wait_seconds;
+        std::copy(std::begin(region.rejected), std::end(region.rejected), entry.rejected);
+        std::copy(std::begin(region.evicted), std::end(region.evicted), entry.evicted);
+        std::copy(std::begin(region.backlog), std::end(region.backlog), entry.backlog);
+        entry.players_delayed = region.players_delayed;
+        entry.admitted_from_backlog = region.admitted_from_backlog;
+        entry.total_admission_delay = region.total_admission_delay;
+        entry.batches = region.batches;
+        entry.batched_parties = region.batched_parties;
+        entry.total_formation_delay = region.total_formation_delay;
+        entry.max_formation_delay = region.max_formation_delay;
+        entry.total_rating_spread = region.total_rating_spread;
+        entry.flex_queued = 0;
+        for (long long queued : region.flex) entry.flex_queued = saturating_add(entry.flex_queued, queued);
+        std::copy(std::begin(region.flex_matched), std::end(region.flex_matched), entry.flex_matched);
+        entry.flex_parties = region.flex_parties;
+        entry.staged = static_cast<long long>(region.staged_count);
+        entry.staged_peak = static_cast<long long>(region.staged_peak);
+        entry.parties_dispatched = region.parties_dispatched;
+        entry.total_dispatch_wait = region.total_dispatch_wait;
+        entry.max_dispatch_wait = region.max_dispatch_wait;
+        entry.stage_full_stalls = region.stage_full_stalls;
+        entry.ready_checks = region.ready_checks;
+        entry.ready_checks_declined = region.ready_checks_declined;
+        entry.ready_checks_timed_out = region.ready_checks_timed_out;
+        entry.players_returned = region.players_returned;
+        entry.players_dropped = region.players_dropped;
+        entry.ready_check_seconds = region.ready_check_seconds;
+        entry.failed_check_seconds = region.failed_check_seconds;
+
+        snapshot.tanks = saturating_add(snapshot.tanks, region.queue[ROLE_TANK]);
+        snapshot.healers = saturating_add(snapshot.healers, region.queue[ROLE_HEALER]);
+        snapshot.dps = saturating_add(snapshot.dps, region.queue[ROLE_DPS]);
+        snapshot.instance_limit += region.instance_limit;
+        snapshot.free_instances += region.free_instance_count;
+        snapshot.parties_formed += region.parties_formed;
+        snapshot.parties_served += region.parties_served;
+        snapshot.total_time_served += region.total_time_served;
+    }
+    snapshot.active_parties = active_parties;
+    snapshot.heap_allocations = heap_allocations.load(std::memory_order_relaxed);
+    snapshot.records_in_use = party_records.in_use();
+    snapshot.record_slabs = party_records.chunks();
+    snapshot.former_wakeups = former_wakeups;
+    snapshot.former_wake_latency_total = former_wake_latency_total;
+    snapshot.former_wake_latency_max = former_wake_latency_max;
+    snapshot.coordinated = !workers.empty();
+    snapshot.coordination = coordination;
+    snapshot.players_cooling_down = players_cooling_down;
+    snapshot.population_returns = population_returns;
+    snapshot.staged_parties = staged_parties;
+    snapshot.population_baseline = population_baseline;
+    {
+        std::lock_guard<std::mutex> lock(rng_mutex);
+        snapshot.min_time = min_time;
+        snapshot.max_time = max_time;
+    }
+    snapshot.players_rejected = players_rejected;
+    snapshot.events_recorded = event_seq;
+    snapshot.events_folded = events_folded.load();
+    snapshot.paused = formation_paused;
+    snapshot.draining = admission_closed;
+    snapshot.idle = is_simulation_idle();
+    snapshot.applied_control_seq = applied_control_seq;
+
+    if (shared_state) write_shared_state(snapshot);
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        std::swap(published_snapshot, snapshot);
+    }
+    snapshot_cv.notify_all();
+}
+
+SimulationSnapshot read_snapshot() {
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    return published_snapshot;
+}
+
+template <typename Predicate>
+SimulationSnapshot wait_for_snapshot(Predicate predicate) {
+    std::unique_lock<std::mutex> lock(snapshot_mutex);
+    snapshot_cv.wait(lock, [&] { return !simulation_running || predicate(published_snapshot); });
+    return published_snapshot;
+}
+
+namespace {
+
+std::string json_escape(std::string_view text) {
+    std::string out;
+    out.reserve(text.size());
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out;
+}
+
+const char* command_name(CommandType type) {
+    switch (type) {
+    case CommandType::Add:
+    case CommandType::AddFlex: return "add";
+    case CommandType::Quit: return "quit";
+    case CommandType::Status: return "status";
+    case CommandType::Stats: return "stats";
+    case CommandType::Scale: return "scale";
+    case CommandType::Pause: return "pause";
+    case CommandType::Resume: return "resume";
+    case CommandType::Drain: return "drain";
+    case CommandType::Seed: return "seed";
+    case CommandType::SetDuration: return "set duration";
+    default: return "";
+    }
+}
+
+std::string snapshot_json(const SimulationSnapshot& snapshot) {
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::stringstream ss;
+    ss << "\"queue\":{\"tank\":" << snapshot.tanks << ",\"healer\":" << snapshot.healers
+       << ",\"dps\":" << snapshot.dps << "}"
+       << ",\"active_parties\":" << snapshot.active_parties
+       << ",\"free_instances\":" << snapshot.free_instances
+       << ",\"instance_limit\":" << snapshot.instance_limit
+       << ",\"paused\":" << (snapshot.paused ? "true" : "false")
+       << ",\"draining\":" << (snapshot.draining ? "true" : "false")
+       << ",\"idle\":" << (snapshot.idle ? "true" : "false")
+       << ",\"min_time\":" << snapshot.min_time << ",\"max_time\":" << snapshot.max_time
+       << ",\"parties_formed\":" << snapshot.parties_formed
+       << ",\"parties_served\":" << snapshot.parties_served
+       << ",\"total_time_served\":" << snapshot.total_time_served
+       << ",\"players_rejected\":" << snapshot.players_rejected
+       << ",\"heap_allocations\":" << snapshot.heap_allocations
+       << ",\"party_records_in_use\":" << snapshot.records_in_use
+       << ",\"party_record_slabs\":" << snapshot.record_slabs
+       << ",\"events_recorded\":" << snapshot.events_recorded << ",\"events_folded\":" << snapshot.events_folded
+       << ",\"former_wakeups\":" << snapshot.former_wakeups
+       << ",\"former_wake_latency_mean\":"
+       << (snapshot.former_wakeups ? snapshot.former_wake_latency_total / snapshot.former_wakeups : 0.0)
+       << ",\"former_wake_latency_max\":" << snapshot.former_wake_latency_max
+       << ",\"applied_seq\":" << snapshot.applied_control_seq;
+    if (closed_population) {
+        ss << ",\"players_cooling_down\":" << snapshot.players_cooling_down
+           << ",\"population_returns\":" << snapshot.population_returns;
+    }
+    ss << std::fixed << std::setprecision(3) << ",\"uptime\":" << uptime << ",\"regions\":[";
+    for (size_t i = 0; i < snapshot.regions.size(); ++i) {
+        const RegionSnapshot& region = snapshot.regions[i];
+        ss << (i ? "," : "") << "{\"name\":\"" << json_escape(region.name) << "\""
+           << ",\"queue\":{\"tank\":" << region.queue[ROLE_TANK] << ",\"healer\":" << region.queue[ROLE_HEALER]
+           << ",\"dps\":" << region.queue[ROLE_DPS] << "}"
+           << ",\"active_parties\":" << region.active_parties
+           << ",\"free_instances\":" << region.free_instances
+           << ",\"instance_limit\":" << region.instance_limit
+           << ",\"parties_formed\":" << region.parties_formed
+           << ",\"cross_region_parties\":" << region.cross_region_parties
+           << ",\"parties_served\":" << region.parties_served
+           << ",\"total_time_served\":" << region.total_time_served
+           << ",\"mean_wait\":" << (region.players_matched ? region.total_wait_seconds / region.players_matched : 0.0);
+        if (queues_bounded()) {
+            ss << ",\"rejected\":" << region.rejected[ROLE_TANK] + region.rejected[ROLE_HEALER] + region.rejected[ROLE_DPS]
+               << ",\"evicted\":" << region.evicted[ROLE_TANK] + region.evicted[ROLE_HEALER] + region.evicted[ROLE_DPS]
+               << ",\"backlog\":{\"tank\":" << region.backlog[ROLE_TANK] << ",\"healer\":" << region.backlog[ROLE_HEALER]
+               << ",\"dps\":" << region.backlog[ROLE_DPS] << "}"
+               << ",\"mean_admission_delay\":"
+               << (region.admitted_from_backlog ? region.total_admission_delay / region.admitted_from_backlog : 0.0);
+        }
+        ss << ",\"batches\":" << region.batches << ",\"batched_parties\":" << region.batched_parties
+           << ",\"mean_formation_delay\":"
+           << (region.batched_parties ? region.total_formation_delay / region.batched_parties : 0.0)
+           << ",\"max_formation_delay\":" << region.max_formation_delay << ",\"mean_rating_spread\":"
+           << (region.batched_parties ? region.total_rating_spread / region.batched_parties : 0.0)
+           << ",\"flex_queued\":" << region.flex_queued << ",\"flex_matched\":{\"tank\":" << region.flex_matched[ROLE_TANK]
+           << ",\"healer\":" << region.flex_matched[ROLE_HEALER] << ",\"dps\":" << region.flex_matched[ROLE_DPS]
+           << "},\"flex_parties\":" << region.flex_parties;
+        if (staging_capacity > 0) {
+            ss << ",\"staged\":" << region.staged << ",\"staged_peak\":" << region.staged_peak
+               << ",\"parties_dispatched\":" << region.parties_dispatched << ",\"mean_dispatch_wait\":"
+               << (region.parties_dispatched ? region.total_dispatch_wait / region.parties_dispatched : 0.0)
+               << ",\"max_dispatch_wait\":" << region.max_dispatch_wait
+               << ",\"stage_full_stalls\":" << region.stage_full_stalls;
+        }
+        if (ready_check_timeout > 0) {
+            ss << ",\"ready_checks\":" << region.ready_checks << ",\"ready_checks_declined\":"
+               << region.ready_checks_declined << ",\"ready_checks_timed_out\":" << region.ready_checks_timed_out
+               << ",\"players_returned\":" << region.players_returned << ",\"players_dropped\":"
+               << region.players_dropped << ",\"ready_check_seconds\":" << region.ready_check_seconds
+               << ",\"failed_check_seconds\":" << region.failed_check_seconds;
+        }
+        ss << "}";
+    }
+    ss << "]";
+    if (snapshot.coordinated) {
+        const CoordinationStats& c = snapshot.coordination;
+        ss << ",\"coordination\":{\"assignments\":" << c.assignments << ",\"assignment_batches\":" << c.assignment_batches
+           << ",\"completions\":" << c.completions << ",\"completion_batches\":" << c.completion_batches
+           << ",\"bytes\":" << c.bytes
+           << ",\"mean_overhead\":" << (c.completions ? c.overhead_seconds / c.completions : 0.0)
+           << ",\"max_overhead\":" << c.max_overhead_seconds << "}";
+    }
+    return ss.str();
+}
+
+} // namespace
+
+// Socket clients get one JSON object per command line. Mutations are queued
+// and acknowledged with their sequence number instead of waiting for idle, and
+// queries answer from the latest published snapshot (its applied_seq says which
+// mutations it reflects), so no client ever stalls the event loop for the others.
+std::string handle_control_line(std::string_view line) {
+    Command command = parse_command(line);
+    switch (command.type) {
+    case CommandType::None:
+        return "";
+    case CommandType::Invalid:
+        return "{\"ok\":false,\"error\":\"" + json_escape(command.error) + "\"}";
+    case CommandType::Unknown:
+        return "{\"ok\":false,\"error\":\"Unknown command: '" + json_escape(command.word) + "'\"}";
+    case CommandType::Quit:
+        request_shutdown();
+        return "{\"ok\":true,\"command\":\"quit\"}";
+    case CommandType::Status:
+    case CommandType::Stats:
+        return std::string("{\"ok\":true,\"command\":\"") + command_name(command.type) + "\","
+               + snapshot_json(read_snapshot()) + "}";
+    default: {
+        unsigned long long seq = post_control(to_control(command));
+        return std::string("{\"ok\":true,\"command\":\"") + command_name(command.type)
+               + "\",\"seq\":" + std::to_string(seq) + "}";
+    }
+    }
+}
+
+#ifdef _WIN32
+void control_server() {
+    log_message("ControlServer", "Control sockets are not supported on this platform.");
+}
+#else
+// Single-threaded poll() loop over the listening socket, every connected
+// client and the shutdown pipe.
+void control_server() {
+    const std::string thread_name = "ControlServer";
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out;
+    };
+    constexpr size_t max_line = 1 << 16;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || control_socket_path.size() >= sizeof(address.sun_path)) {
+        log_message(thread_name, "Could not create control socket at '" + control_socket_path + "'.");
+        if (listener >= 0) close(listener);
+        return;
+    }
+    std::copy(control_socket_path.begin(), control_socket_path.end(), address.sun_path);
+    unlink(control_socket_path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        log_message(thread_name, "Could not bind control socket at '" + control_socket_path + "'.");
+        close(listener);
+        return;
+    }
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    log_message(thread_name, "Listening on " + control_socket_path);
+
+    std::vector<Client> clients;
+    std::vector<pollfd> fds;
+    char buffer[4096];
+
+    while (simulation_running) {
+        fds.clear();
+        fds.push_back({shutdown_pipe[0], POLLIN, 0});
+        fds.push_back({listener, POLLIN, 0});
+        for (const auto& client : clients) {
+            fds.push_back({client.fd, static_cast<short>(POLLIN | (client.out.empty() ? 0 : POLLOUT)), 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+        if (fds[0].revents & POLLIN) break;
+
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                clients.push_back({fd, {}, {}});
+                log_message(thread_name, "Client connected (" + std::to_string(clients.size()) + " open).");
+            }
+        }
+
+        for (size_t i = 0; i < clients.size() && i + 2 < fds.size(); ++i) {
+            Client& client = clients[i];
+            short revents = fds[i + 2].revents;
+            bool closed = (revents & (POLLERR | POLLNVAL)) != 0;
+
+            if (!closed && (revents & (POLLIN | POLLHUP))) {
+                ssize_t received = read(client.fd, buffer, sizeof(buffer));
+                if (received <= 0) {
+                    closed = true;
+                } else {
+                    client.in.append(buffer, static_cast<size_t>(received));
+                    size_t line_start = 0, newline;
+                    while ((newline = client.in.find('\n', line_start)) != std::string::npos) {
+                        std::string response =
+                            handle_control_line(std::string_view(client.in).substr(line_start, newline - line_start));
+                        if (!response.empty()) client.out += response + "\n";
+                        line_start = newline + 1;
+                    }
+                    client.in.erase(0, line_start);
+                    if (client.in.size() > max_line) {
+                        client.out += "{\"ok\":false,\"error\":\"Line too long\"}\n";
+                        client.in.clear();
+                    }
+                }
+            }
+
+            if (!closed && !client.out.empty()) {
+                ssize_t sent = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+                if (sent > 0) client.out.erase(0, static_cast<size_t>(sent));
+                else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) closed = true;
+            }
+
+            if (closed) {
+                close(client.fd);
+                client.fd = -1;
+            }
+        }
+        clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client& c) { return c.fd < 0; }),
+                      clients.end());
+    }
+
+    // Best-effort flush of final responses (e.g. the reply to quit).
+    for (auto& client : clients) {
+        if (!client.out.empty()) send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+        close(client.fd);
+    }
+    close(listener);
+    unlink(control_socket_path.c_str());
+    log_message(thread_name, "Control socket closed.");
+}
+#endif
+
+// Sends each worker the assignments queued during one former pass as a single
+// write. The lock is released first: a worker blocked on sending completions
+// must never wait on a former that is blocked on sending it assignments.
+void flush_worker_assignments(std::unique_lock<std::mutex>& lock) {
+    std::vector<std::string> batches(workers.size());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        batches[i].swap(workers[i]->outbox);
+        if (batches[i].empty()) continue;
+        coordination.assignment_batches++;
+        coordination.bytes += batches[i].size();
+    }
+    lock.unlock();
+
+#ifndef _WIN32
+    for (size_t i = 0; i < workers.size(); ++i) {
+        std::string_view rest = batches[i];
+        std::lock_guard<std::mutex> write_lock(workers[i]->write_mutex);
+        while (!rest.empty()) {
+            ssize_t sent = write(workers[i]->fd, rest.data(), rest.size());
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            rest.remove_prefix(static_cast<size_t>(sent));
+        }
+    }
+#endif
+}
+
+#ifdef _WIN32
+bool spawn_workers(int) {
+    log_message("MainThread", "Worker processes are not supported on this platform.");
+    return false;
+}
+void worker_listener() {}
+void stop_workers(const std::string&) {}
+#else
+namespace {
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = write(fd, data.data(), data.size());
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data.remove_prefix(static_cast<size_t>(sent));
+    }
+    return true;
+}
+
+// Body of a forked worker: times its assigned runs on a deadline heap and
+// reports every run that finished during one wakeup as one batch. It only
+// touches its socket, so nothing inherited from the coordinator is shared.
+int run_worker(int fd) {
+    struct PendingRun {
+        std::chrono::steady_clock::time_point finish;
+        int region;
+        int instance_id;
+        int duration;
+        bool operator>(const PendingRun& other) const { return finish > other.finish; }
+    };
+    std::priority_queue<PendingRun, std::vector<PendingRun>, std::greater<PendingRun>> due;
+    long long runs = 0, busy_seconds = 0, batches = 0;
+    std::string in;
+    char buffer[4096];
+
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        std::stringstream out;
+        while (!due.empty() && due.top().finish <= now) {
+            const PendingRun& run = due.top();
+            out << "C " << run.region << " " << run.instance_id << " " << run.duration << "\n";
+            runs++;
+            busy_seconds += run.duration;
+            due.pop();
+        }
+        if (out.tellp() > 0) {
+            batches++;
+            if (!write_all(fd, out.str())) return 1;
+        }
+
+        int timeout = -1;
+        if (!due.empty()) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due.top().finish - now);
+            timeout = static_cast<int>(std::min<long long>(wait.count() + 1, std::numeric_limits<int>::max()));
+        }
+        pollfd link{fd, POLLIN, 0};
+        if (poll(&link, 1, timeout) <= 0) continue;
+
+        ssize_t received = read(fd, buffer, sizeof(buffer));
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return 0;  // coordinator went away
+        in.append(buffer, static_cast<size_t>(received));
+
+        size_t line_start = 0, newline;
+        bool stopping = false;
+        while ((newline = in.find('\n', line_start)) != std::string::npos) {
+            std::string_view line = std::string_view(in).substr(line_start, newline - line_start);
+            line_start = newline + 1;
+            std::string_view type = next_token(line);
+            PendingRun run{};
+            if (type == "Q") {
+                stopping = true;
+            } else if (type == "A" && parse_number(next_token(line), run.region)
+                       && parse_number(next_token(line), run.instance_id) && parse_number(next_token(line), run.duration)) {
+                run.finish = std::chrono::steady_clock::now() + std::chrono::seconds(run.duration);
+                due.push(run);
+            }
+        }
+        in.erase(0, line_start);
+
+        // The coordinator only sends Q once no party is active.
+        if (stopping) {
+            std::stringstream report;
+            report << "R " << runs << " " << busy_seconds << " " << batches << "\n";
+            write_all(fd, report.str());
+            return 0;
+        }
+    }
+}
+
+} // namespace
+
+bool spawn_workers(int count) {
+    std::cout.flush();
+    for (int i = 0; i < count; ++i) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) return false;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(pair[0]);
+            close(pair[1]);
+            return false;
+        }
+        if (pid == 0) {
+            // Drop the coordinator ends of earlier workers so their EOF is seen.
+            for (const auto& worker : workers) close(worker->fd);
+            close(pair[0]);
+            if (!numa_nodes.empty()) pin_current_thread(numa_nodes[i % numa_nodes.size()]);
+            _exit(run_worker(pair[1]));
+        }
+        close(pair[1]);
+        auto worker = std::make_unique<WorkerLink>();
+        worker->fd = pair[0];
+        worker->pid = static_cast<int>(pid);
+        workers.push_back(std::move(worker));
+    }
+    log_message("MainThread", "Started " + std::to_string(count) + " worker process(es).");
+    return true;
+}
+
+// Reads completion batches from every worker and applies each batch under a
+// single g_mutex acquisition. Exits once every worker has closed its socket.
+void worker_listener() {
+    const std::string thread_name = "WorkerLink";
+    place_worker_thread(thread_name, -1);
+    EpochArena<16384> arena;  // one completion batch per epoch
+    std::vector<std::string> in(workers.size());
+    std::vector<bool> open(workers.size(), true);
+    size_t open_count = workers.size();
+    std::vector<pollfd> fds;
+    std::vector<size_t> polled;
+    char buffer[4096];
+
+    while (open_count > 0) {
+        fds.clear();
+        polled.clear();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            if (!open[i]) continue;
+            fds.push_back({workers[i]->fd, POLLIN, 0});
+            polled.push_back(i);
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+
+        for (size_t k = 0; k < fds.size(); ++k) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            size_t i = polled[k];
+            ssize_t received = read(workers[i]->fd, buffer, sizeof(buffer));
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) {
+                open[i] = false;
+                open_count--;
+                continue;
+            }
+            in[i].append(buffer, static_cast<size_t>(received));
+
+            struct Completion {
+                int region;
+                int instance_id;
+                int duration;
+            };
+            arena.reset();
+            std::pmr::vector<Completion> completed(arena.resource());
+            size_t line_start = 0, newline;
+            while ((newline = in[i].find('\n', line_start)) != std::string::npos) {
+                std::string_view line = std::string_view(in[i]).substr(line_start, newline - line_start);
+                line_start = newline + 1;
+                std::string_view type = next_token(line);
+                Completion run{};
+                long long runs, busy_seconds, batches;
+                if (type == "C" && parse_number(next_token(line), run.region)
+                    && parse_number(next_token(line), run.instance_id) && parse_number(next_token(line), run.duration)
+                    && run.region >= 0 && run.region < static_cast<int>(regions.size()) && run.instance_id >= 0) {
+                    completed.push_back(run);
+                } else if (type == "R" && parse_number(next_token(line), runs)
+                           && parse_number(next_token(line), busy_seconds) && parse_number(next_token(line), batches)) {
+                    std::stringstream report;
+                    report << runs << " runs timed, " << busy_seconds << "s busy, " << batches << " completion batches";
+                    std::lock_guard<std::mutex> lock(g_mutex);
+                    workers[i]->report = report.str();
+                } else {
+                    log_message(thread_name, "Ignoring malformed message from worker " + std::to_string(i) + ".");
+                }
+            }
+            in[i].erase(0, line_start);
+            if (completed.empty()) continue;
+
+            {
+                std::lock_guard<std::mutex> lock(g_mutex);
+                auto now = std::chrono::steady_clock::now();
+                for (const auto& run : completed) {
+                    Region& region = regions[run.region];
+                    if (run.instance_id >= static_cast<int>(region.instances.size())) continue;
+                    const PartyRecord* party = region.instances[run.instance_id].party;
+                    if (!party) continue;
+                    double overhead = std::chrono::duration<double>(now - party->started).count() - run.duration;
+                    coordination.overhead_seconds += std::max(0.0, overhead);
+                    coordination.max_overhead_seconds = std::max(coordination.max_overhead_seconds, overhead);
+                    coordination.completions++;
+                    finish_run(run.region, run.instance_id, run.duration);
+                }
+                coordination.completion_batches++;
+                coordination.bytes += received;
+                publish_snapshot();
+            }
+            note_wake_request();
+            cv.notify_all();
+        }
+    }
+    for (const auto& worker : workers) close(worker->fd);
+}
+
+// Called after the formers exit, when no run is outstanding.
+void stop_workers(const std::string& thread_name) {
+    for (const auto& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->write_mutex);
+        if (!write_all(worker->fd, "Q\n")) log_message(thread_name, "Worker " + std::to_string(worker->pid) + " is gone.");
+    }
+    for (const auto& worker : workers) waitpid(static_cast<pid_t>(worker->pid), nullptr, 0);
+}
+#endif
+
+void mark_status_changed(int region_index, int instance_id) {
+    if (shared_state) shared_status_dirty.push_back({region_index, instance_id});
+}
+
+namespace {
+
+SharedRegion* shared_regions(SharedStateHeader* header) {
+    return reinterpret_cast<SharedRegion*>(header + 1);
+}
+
+std::atomic<uint8_t>* shared_statuses(SharedStateHeader* header) {
+    return reinterpret_cast<std::atomic<uint8_t>*>(shared_regions(header) + header->region_count);
+}
+
+size_t shared_state_bytes(uint32_t region_count, uint32_t capacity) {
+    return sizeof(SharedStateHeader) + region_count * sizeof(SharedRegion) + size_t(region_count) * capacity;
+}
+
+void store_counters(SharedCounters& target, const long long (&queue)[ROLE_COUNT], int active, int limit, int free,
+                    long long formed, long long served, long long total_time) {
+    for (int role = 0; role < ROLE_COUNT; ++role) target.queue[role].store(queue[role], std::memory_order_relaxed);
+    target.active_parties.store(active, std::memory_order_relaxed);
+    target.instance_limit.store(limit, std::memory_order_relaxed);
+    target.free_instances.store(free, std::memory_order_relaxed);
+    target.parties_formed.store(formed, std::memory_order_relaxed);
+    target.parties_served.store(served, std::memory_order_relaxed);
+    target.total_time_served.store(total_time, std::memory_order_relaxed);
+}
+
+} // namespace
+
+// Called from publish_snapshot() with g_mutex held; no system calls.
+void write_shared_state(const SimulationSnapshot& snapshot) {
+    SharedStateHeader* header = shared_state;
+    uint64_t sequence = header->sequence.load(std::memory_order_relaxed);
+    header->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    auto uptime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+    header->uptime_ms.store(uptime.count(), std::memory_order_relaxed);
+    header->players_rejected.store(snapshot.players_rejected, std::memory_order_relaxed);
+    header->flags.store((snapshot.paused ? 1 : 0) | (snapshot.draining ? 2 : 0) | (snapshot.idle ? 4 : 0),
+                        std::memory_order_relaxed);
+    header->applied_seq.store(static_cast<int64_t>(snapshot.applied_control_seq), std::memory_order_relaxed);
+    const long long totals[ROLE_COUNT] = {snapshot.tanks, snapshot.healers, snapshot.dps};
+    store_counters(header->totals, totals, snapshot.active_parties, snapshot.instance_limit, snapshot.free_instances,
+                   snapshot.parties_formed, snapshot.parties_served, snapshot.total_time_served);
+    SharedRegion* shared = shared_regions(header);
+    for (size_t i = 0; i < snapshot.regions.size(); ++i) {
+        const RegionSnapshot& region = snapshot.regions[i];
+        store_counters(shared[i].counters, region.queue, region.active_parties, region.instance_limit,
+                       region.free_instances, region.parties_formed, region.parties_served, region.total_time_served);
+    }
+    std::atomic<uint8_t>* statuses = shared_statuses(header);
+    for (auto [region_index, instance_id] : shared_status_dirty) {
+        if (instance_id >= static_cast<int>(header->instance_capacity)) continue;
+        bool active = regions[region_index].instances[instance_id].status != "empty";
+        statuses[size_t(region_index) * header->instance_capacity + instance_id].store(active ? 1 : 0,
+                                                                                    std::memory_order_relaxed);
+    }
+    shared_status_dirty.clear();
+
+    header->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+#ifdef _WIN32
+bool create_shared_state(const std::string&, int) {
+    log_message("MainThread", "Shared memory state is not supported on this platform.");
+    return false;
+}
+void destroy_shared_state() {}
+int dump_shared_state(const std::string&) {
+    std::cerr << "Shared memory state is not supported on this platform.\n";
+    return 1;
+}
+#else
+bool create_shared_state(const std::string& name, int capacity) {
+    size_t bytes = shared_state_bytes(static_cast<uint32_t>(regions.size()), static_cast<uint32_t>(capacity));
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    void* memory = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) {
+        memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // Fresh pages are zeroed: every counter and status starts at 0.
+    SharedStateHeader* header = new (memory) SharedStateHeader{};
+    header->region_count = static_cast<uint32_t>(regions.size());
+    header->instance_capacity = static_cast<uint32_t>(capacity);
+    SharedRegion* shared = shared_regions(header);
+    for (size_t i = 0; i < regions.size(); ++i) {
+        new (&shared[i]) SharedRegion{};
+        std::strncpy(shared[i].name, regions[i].name.c_str(), sizeof(shared[i].name) - 1);
+    }
+    header->version = shm_layout_version;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = shm_magic;  // last, so a reader never sees a half-built layout as valid
+
+    shared_state = header;
+    shared_state_size = bytes;
+    shared_state_name = name;
+    log_message("MainThread", "Publishing state in shared memory " + name + " (" + std::to_string(bytes) + " bytes).");
+    return true;
+}
+
+void destroy_shared_state() {
+    if (!shared_state) return;
+    munmap(shared_state, shared_state_size);
+    shm_unlink(shared_state_name.c_str());
+    shared_state = nullptr;
+}
+
+// A reference reader: one consistent seqlock read, printed as JSON.
+int dump_shared_state(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(SharedStateHeader)) {
+        std::cerr << "Could not open shared memory segment '" << name << "'.\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    size_t bytes = static_cast<size_t>(info.st_size);
+    void* memory = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Could not map shared memory segment '" << name << "'.\n";
+        return 1;
+    }
+    auto* header = static_cast<SharedStateHeader*>(memory);
+    if (header->magic != shm_magic || header->version != shm_layout_version
+        || bytes < shared_state_bytes(header->region_count, header->instance_capacity)) {
+        std::cerr << "Segment '" << name << "' has an unknown layout.\n";
+        munmap(memory, bytes);
+        return 1;
+    }
+
+    struct Counters {
+        int64_t values[ROLE_COUNT + 6];
+    };
+    auto load = [](const SharedCounters& source) {
+        Counters out;
+        for (int role = 0; role < ROLE_COUNT; ++role) out.values[role] = source.queue[role].load(std::memory_order_relaxed);
+        out.values[3] = source.active_parties.load(std::memory_order_relaxed);
+        out.values[4] = source.instance_limit.load(std::memory_order_relaxed);
+        out.values[5] = source.free_instances.load(std::memory_order_relaxed);
+        out.values[6] = source.parties_formed.load(std::memory_order_relaxed);
+        out.values[7] = source.parties_served.load(std::memory_order_relaxed);
+        out.values[8] = source.total_time_served.load(std::memory_order_relaxed);
+        return out;
+    };
+    uint32_t region_count = header->region_count;
+    uint32_t capacity = header->instance_capacity;
+    SharedRegion* shared = shared_regions(header);
+    std::atomic<uint8_t>* statuses = shared_statuses(header);
+
+    uint64_t sequence;
+    int64_t uptime_ms, rejected, flags, applied;
+    Counters totals;
+    std::vector<Counters> per_region(region_count);
+    std::vector<uint8_t> status(size_t(region_count) * capacity);
+    int attempts = 0;
+    while (true) {
+        if (attempts == shm_max_read_attempts) {
+            std::cerr << "Segment '" << name << "' never settled after " << attempts
+                      << " reads: the writer is inconsistent or stale (sequence "
+                      << header->sequence.load(std::memory_order_relaxed) << ").\n";
+            munmap(memory, bytes);
+            return 1;
+        }
+        // Yield through a brief write, then back off so a stuck writer is not spun on.
+        if (attempts++ > 0) {
+            if (attempts < 16) std::this_thread::yield();
+            else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        sequence = header->sequence.load(std::memory_order_acquire);
+        if (sequence & 1) continue;
+        uptime_ms = header->uptime_ms.load(std::memory_order_relaxed);
+        rejected = header->players_rejected.load(std::memory_order_relaxed);
+        flags = header->flags.load(std::memory_order_relaxed);
+        applied = header->applied_seq.load(std::memory_order_relaxed);
+        totals = load(header->totals);
+        for (uint32_t i = 0; i < region_count; ++i) per_region[i] = load(shared[i].counters);
+        for (size_t i = 0; i < status.size(); ++i) status[i] = statuses[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->sequence.load(std::memory_order_relaxed) == sequence) break;
+    }
+
+    static const char* const counter_names[] = {"tank", "healer", "dps", "active_parties", "instance_limit",
+                                                "free_instances", "parties_formed", "parties_served",
+                                                "total_time_served"};
+    auto print_counters = [](const Counters& counters) {
+        for (int i = 0; i < ROLE_COUNT + 6; ++i) std::cout << (i ? "," : "") << "\"" << counter_names[i] << "\":" << counters.values[i];
+    };
+    std::cout << "{\"version\":" << header->version << ",\"sequence\":" << sequence << ",\"read_attempts\":" << attempts
+              << ",\"uptime_ms\":" << uptime_ms << ",\"players_rejected\":" << rejected
+              << ",\"paused\":" << ((flags & 1) ? "true" : "false") << ",\"draining\":" << ((flags & 2) ? "true" : "false")
+              << ",\"idle\":" << ((flags & 4) ? "true" : "false") << ",\"applied_seq\":" << applied << ",";
+    print_counters(totals);
+    std::cout << ",\"regions\":[";
+    for (uint32_t i = 0; i < region_count; ++i) {
+        std::string region_name(shared[i].name, strnlen(shared[i].name, sizeof(shared[i].name)));
+        std::cout << (i ? "," : "") << "{\"name\":\"" << json_escape(region_name) << "\",";
+        print_counters(per_region[i]);
+        std::cout << ",\"active_instances\":[";
+        bool first = true;
+        for (uint32_t id = 0; id < capacity; ++id) {
+            if (!status[size_t(i) * capacity + id]) continue;
+            std::cout << (first ? "" : ",") << id;
+            first = false;
+        }
+        std::cout << "]}";
+    }
+    std::cout << "]}" << std::endl;
+    munmap(memory, bytes);
+    return 0;
+}
+#endif
+
+// One former per region. Besides local parties it forms cross-region parties
+// once the region's oldest player has waited overflow_after seconds, so it
+// sleeps until that deadline when one is pending.
+void party_former(int region_index) {
+    const std::string thread_name = region_thread_name("PartyFormer", region_index);
+    Region& region = regions[region_index];
+    auto can_start_party = [&region](std::chrono::steady_clock::time_point now) {
+        if (formation_paused || formation_slots(region) == 0) return false;
+        if (can_form_party(region)) return batch_due(region, now);
+        region.batch_opened.reset();
+        auto deadline = overflow_deadline(region);
+        return deadline && *deadline <= now;
+    };
+    if (region.node >= 0 && former_placement.cpus.empty() && !pin_current_thread(numa_nodes[region.node])) {
+        log_message(thread_name, "Could not pin to NUMA node " + std::to_string(region.node) + ".");
+    }
+    std::string placement_error;
+    if (!apply_thread_placement(former_placement, region_index, placement_error)) {
+        log_message(thread_name, "Former placement: " + placement_error + ".");
+    }
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(g_mutex);
+        auto sleep_started = std::chrono::steady_clock::now() - start_time;
+        bool slept = false;
+        while (true) {
+            bool has_work_to_do = can_start_party(std::chrono::steady_clock::now());
+            bool is_shutting_down = !simulation_running && active_parties == 0 && staged_parties == 0;
+            if (has_work_to_do || is_shutting_down || control_pending) break;
+
+            slept = true;
+            auto deadline = overflow_deadline(region);
+            auto window_closes = batch_deadline(region);
+            if (window_closes && (!deadline || *window_closes < *deadline)) deadline = window_closes;
+            if (deadline && !formation_paused && formation_slots(region) > 0) cv.wait_until(lock, *deadline);
+            else cv.wait(lock);
+        }
+        auto requested = std::chrono::nanoseconds(wake_requested_ns.load());
+        if (slept && requested >= sleep_started) {
+            double latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time - requested).count();
+            former_wakeups++;
+            former_wake_latency_total += latency;
+            former_wake_latency_max = std::max(former_wake_latency_max, latency);
+        }
+
+        bool control_applied = control_pending;
+        apply_control_commands(thread_name);
+        // A scale-up may have reallocated the pool on another former's node.
+        if (region.node >= 0 && region.instances.data() != region.homed_instances) rehome_instances(region);
+
+        if (!simulation_running && active_parties == 0 && staged_parties == 0) {
+            log_message(thread_name, "Shutdown signal received and no more work to do. Exiting.");
+            publish_snapshot();
+            if (staging_capacity > 0) {
+                lock.unlock();
+                cv.notify_all();  // the dispatcher exits on the same condition
+            }
+            return;
+        }
+
+        // Forming parties frees queue space for players held back by the delay policy.
+        auto now = std::chrono::steady_clock::now();
+        long long formed = region.parties_formed;
+        do {
+            while (can_start_party(now)) {
+                if (can_form_party(region)) form_batch(region_index, thread_name, now);
+                else form_party(region_index, thread_name, now);
+            }
+        } while (admit_backlogs(now));
+        if (staging_capacity > 0 && formation_slots(region) == 0 && can_form_party(region)) region.stage_full_stalls++;
+
+        publish_snapshot();
+        if (!workers.empty()) flush_worker_assignments(lock);
+        // Staged parties and scale-ups are the dispatcher's work.
+        if (staging_capacity > 0) {
+            if (lock.owns_lock()) lock.unlock();
+            if (region.parties_formed != formed || control_applied) cv.notify_all();
+        }
+    }
+}
+
+// Forms one batch of local parties. Immediate matching forms a single party
+// from the oldest players. A batch takes the oldest players for k parties,
+// sorts each role by rating and deals consecutive slices to the parties, so a
+// longer window (larger k) buys tighter parties. Called with g_mutex held.
+void form_batch(int region_index, const std::string& thread_name, std::chrono::steady_clock::time_point now) {
+    static std::vector<int> ratings[ROLE_COUNT];  // reused across batches; guarded by g_mutex
+    Region& region = regions[region_index];
+    long long parties = batch_window > 0 ? formable_parties(region) : 1;
+    if (batch_max_parties > 0) parties = std::min<long long>(parties, batch_max_parties);
+
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        size_t wanted = static_cast<size_t>(parties * party_template[role]);
+        ratings[role].clear();
+        for (const QueuedBatch& batch : region.waiting[role]) {
+            for (long long i = 0; i < batch.count && ratings[role].size() < wanted; ++i) {
+                ratings[role].push_back(player_rating(region_index, role, batch.first + i));
+            }
+            if (ratings[role].size() == wanted) break;
+        }
+        std::sort(ratings[role].begin(), ratings[role].end());
+    }
+    for (long long party = 0; party < parties; ++party) {
+        int lowest = std::numeric_limits<int>::max(), highest = std::numeric_limits<int>::min();
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            for (int slot = 0; slot < party_template[role]; ++slot) {
+                size_t index = static_cast<size_t>(party * party_template[role] + slot);
+                if (index >= ratings[role].size()) break;  // filled by a flex player, who has no rating
+                int rating = ratings[role][index];
+                lowest = std::min(lowest, rating);
+                highest = std::max(highest, rating);
+            }
+        }
+        if (lowest <= highest) region.total_rating_spread += highest - lowest;
+    }
+
+    double delay = region.batch_opened ? std::chrono::duration<double>(now - *region.batch_opened).count() : 0.0;
+    region.batches++;
+    region.batched_parties += parties;
+    region.total_formation_delay += parties * delay;
+    region.max_formation_delay = std::max(region.max_formation_delay, delay);
+    region.batch_opened.reset();
+    for (long long party = 0; party < parties; ++party) form_party(region_index, thread_name, now);
+}
+
+// Takes the region's own players first. A cross-region party fills the rest
+// from the other regions, oldest waiting players first, and runs longer by
+// cross_region_penalty. Called by the former with g_mutex held.
+void form_party(int region_index, const std::string& thread_name, std::chrono::steady_clock::time_point now) {
+    Region& region = regions[region_index];
+    bool cross_region = !can_form_party(region);
+    long long local[ROLE_COUNT] = {0, 0, 0};
+    long long borrowed[ROLE_COUNT] = {0, 0, 0};
+    StagedParty party;
+    long long (&from_flex)[ROLE_MASKS][ROLE_COUNT] = party.sources.flex;
+
+    // Single-role players can only fill their own role, so they go first.
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        local[role] = std::min<long long>(party_template[role], region.queue[role]);
+        dequeue_players(region, role, local[role], now);
+        borrowed[role] = party_template[role] - local[role];
+    }
+    assign_flex_players(region, borrowed, from_flex);
+    bool used_flex = false;
+    for (int mask = 0; mask < ROLE_MASKS; ++mask) {
+        long long players = 0;
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            players += from_flex[mask][role];
+            region.flex_matched[role] += from_flex[mask][role];
+        }
+        if (players == 0) continue;
+        dequeue_flex_players(region, mask, players, now);
+        record_event(EventType::FlexMatched, region_index, mask, from_flex[mask], 0, now);
+        used_flex = true;
+    }
+    if (used_flex) region.flex_parties++;
+
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        for (long long needed = borrowed[role]; needed > 0;) {
+            Region* donor = nullptr;
+            for (auto& other : regions) {
+                if (&other == &region || other.waiting[role].empty()) continue;
+                if (!donor || other.waiting[role].front().since < donor->waiting[role].front().since) donor = &other;
+            }
+            long long taken = std::min(needed, donor->waiting[role].front().count);
+            dequeue_players(*donor, role, taken, now);
+            record_role_event(EventType::PlayersBorrowed, *donor, role, taken, now);
+            party.sources.loans.push_back({static_cast<int>(donor - regions.data()), role, taken});
+            needed -= taken;
+        }
+    }
+
+    region.parties_formed++;
+    if (cross_region) region.cross_region_parties++;
+    std::copy(std::begin(borrowed), std::end(borrowed), party.borrowed);
+    party.cross_region = cross_region;
+    party.staged_at = now;
+    if (staging_capacity == 0) {
+        dispatch_party(region_index, party, local, thread_name, now);
+        return;
+    }
+
+    record_event(EventType::PartyFormed, region_index, -1, local, 0, now);
+    region.staged[(region.staged_head + region.staged_count) % region.staged.size()] = std::move(party);
+    region.staged_peak = std::max(region.staged_peak, ++region.staged_count);
+    staged_parties++;
+    if (log_level >= LogLevel::Normal) {
+        std::stringstream ss;
+        ss << (cross_region ? "Cross-region party" : "Party") << " formed! Staged for dispatch ("
+           << region.staged_count << "/" << staging_capacity << "). Remaining Queue: " << region.queue[ROLE_TANK]
+           << "T, " << region.queue[ROLE_HEALER] << "H, " << region.queue[ROLE_DPS] << "D";
+        log_message(thread_name, ss.str());
+    }
+}
+
+// Puts a formed party on a free instance and starts its run: straight from
+// form_party(), or from the staging queue with local == nullptr. Called with
+// g_mutex held and a free instance available.
+void dispatch_party(int region_index, const StagedParty& party, const long long* local, const std::string& thread_name,
+                    std::chrono::steady_clock::time_point now) {
+    Region& region = regions[region_index];
+    int instance_id = acquire_free_instance(region);
+    if (local) record_event(EventType::PartyFormed, region_index, instance_id, local, 0, now);
+    else record_event(EventType::PartyDispatched, region_index, instance_id, nullptr, 0, now);
+    region.instances[instance_id].status = "active";
+    mark_status_changed(region_index, instance_id);
+    region.active_parties++;
+    active_parties++;
+
+    if (log_level >= LogLevel::Normal) {
+        std::stringstream ss;
+        if (!local) {
+            ss << std::fixed << std::setprecision(2) << "Dispatching staged party to Instance " << instance_id
+               << " after " << std::chrono::duration<double>(now - party.staged_at).count() << "s in staging";
+        } else if (party.cross_region) {
+            ss << "Cross-region party formed with " << party.borrowed[ROLE_TANK] << "T, " << party.borrowed[ROLE_HEALER]
+               << "H, " << party.borrowed[ROLE_DPS] << "D from other regions! Assigning to Instance " << instance_id;
+        } else {
+            ss << "Party formed! Assigning to Instance " << instance_id;
+        }
+        if (local) {
+            ss << ". Remaining Queue: " << region.queue[ROLE_TANK] << "T, " << region.queue[ROLE_HEALER] << "H, "
+               << region.queue[ROLE_DPS] << "D";
+        }
+        log_message(thread_name, ss.str());
+
+        print_status(region, thread_name);
+        log_message(thread_name, "----------------------------------------");
+    }
+
+    int extra_seconds = party.cross_region ? cross_region_penalty : 0;
+    if (ready_check_timeout > 0) begin_ready_check(region_index, instance_id, extra_seconds, party.sources, now);
+    else start_run(region_index, instance_id, extra_seconds);
+}
+
+// The second stage: moves staged parties onto instances as they free, so the
+// former matches at the pace of arrivals and this thread allocates at the pace
+// of completions. Exits with the former once nothing is queued or running.
+void party_dispatcher(int region_index) {
+    const std::string thread_name = region_thread_name("Dispatcher", region_index);
+    Region& region = regions[region_index];
+    if (region.node >= 0 && former_placement.cpus.empty() && !pin_current_thread(numa_nodes[region.node])) {
+        log_message(thread_name, "Could not pin to NUMA node " + std::to_string(region.node) + ".");
+    }
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(g_mutex);
+        cv.wait(lock, [&region] {
+            return (region.staged_count > 0 && has_free_instance(region))
+                   || (!simulation_running && active_parties == 0 && staged_parties == 0);
+        });
+        if (region.staged_count == 0 || !has_free_instance(region)) {
+            log_message(thread_name, "Shutdown signal received and no more work to do. Exiting.");
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        account_idle_time(region, now);
+        while (region.staged_count > 0 && has_free_instance(region)) {
+            StagedParty party = std::move(region.staged[region.staged_head]);
+            region.staged_head = (region.staged_head + 1) % region.staged.size();
+            region.staged_count--;
+            staged_parties--;
+            double wait = std::chrono::duration<double>(now - party.staged_at).count();
+            region.parties_dispatched++;
+            region.total_dispatch_wait += wait;
+            region.max_dispatch_wait = std::max(region.max_dispatch_wait, wait);
+            dispatch_party(region_index, party, nullptr, thread_name, now);
+        }
+
+        publish_snapshot();
+        if (!workers.empty()) flush_worker_assignments(lock);
+        if (lock.owns_lock()) lock.unlock();
+        // The stage has room again.
+        note_wake_request();
+        cv.notify_all();
+    }
+}
+
+// Called by the former with g_mutex held.
+void start_run(int region_index, int instance_id, int extra_seconds) {
+    PartyRecord* party = party_records.acquire();
+    party->region = region_index;
+    party->instance_id = instance_id;
+    party->extra_seconds = extra_seconds;
+    party->started = std::chrono::steady_clock::now();
+    regions[region_index].instances[instance_id].party = party;
+    launch_run(party);
+}
+
+// Hands a started record to the run scheduler. Called with g_mutex held.
+void launch_run(PartyRecord* party) {
+    int region_index = party->region;
+    int instance_id = party->instance_id;
+    if (run_scheduler == RunScheduler::Thread) {
+        std::thread(dungeon_run, party).detach();
+        return;
+    }
+
+    int time_in_dungeon = begin_run(*party);
+    if (run_scheduler == RunScheduler::Process) {
+        // Formatted in place: the outbox keeps its capacity between batches.
+        std::string& outbox = workers[instance_id % workers.size()]->outbox;
+        char line[48];
+        int length = std::snprintf(line, sizeof(line), "A %d %d %d\n", region_index, instance_id, time_in_dungeon);
+        outbox.append(line, static_cast<size_t>(length));
+        coordination.assignments++;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        timer_queue.push({party->started + std::chrono::seconds(time_in_dungeon), party});
+    }
+    timer_cv.notify_one();
+}
+
+// The record is written before the thread starts and released by
+// finish_run(), so this thread may read it without g_mutex until then.
+void dungeon_run(PartyRecord* party) {
+    place_worker_thread("DungeonRun", party->region);
+    int time_in_dungeon = begin_run(*party);
+    std::this_thread::sleep_for(std::chrono::seconds(time_in_dungeon));
+    complete_run(party->region, party->instance_id, time_in_dungeon);
+}
+
+void timer_scheduler() {
+    place_worker_thread("TimerScheduler", -1);
+    std::unique_lock<std::mutex> lock(timer_mutex);
+    while (true) {
+        if (timer_queue.empty()) {
+            if (timer_stopping) return;
+            timer_cv.wait(lock);
+            continue;
+        }
+        ScheduledRun next = timer_queue.top();
+        if (timer_cv.wait_until(lock, next.finish) != std::cv_status::timeout
+            && std::chrono::steady_clock::now() < next.finish) {
+            continue;  // woken early: a sooner deadline may have been pushed
+        }
+        timer_queue.pop();
+        lock.unlock();
+        complete_run(next.party->region, next.party->instance_id, next.party->duration);
+        lock.lock();
+    }
+}
+
+// Reserves the instance and draws every member's answer: an exponential
+// response time, declining with probability ready_check_decline. The check
+// fails at the first decline, or at the timeout if anyone has not answered;
+// those members leave and the rest go back to the front of the queue they
+// came from. Called with g_mutex held.
+void begin_ready_check(int region_index, int instance_id, int extra_seconds, const PartySources& sources,
+                       std::chrono::steady_clock::time_point now) {
+    static std::vector<std::pair<double, int>> answers[ROLE_COUNT];  // (seconds, declined); guarded by g_mutex
+    Region& region = regions[region_index];
+    PartyRecord* party = party_records.acquire();
+    party->region = region_index;
+    party->instance_id = instance_id;
+    party->extra_seconds = extra_seconds;
+    region.instances[instance_id].party = party;
+    region.instances[instance_id].status = "ready-check";
+    mark_status_changed(region_index, instance_id);
+    region.ready_checks++;
+
+    std::uniform_real_distribution<> chance(0.0, 1.0);
+    std::exponential_distribution<> response(1.0 / ready_check_response);
+    double fails_at = std::numeric_limits<double>::infinity(), all_accepted_at = 0;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        answers[role].clear();
+        for (int slot = 0; slot < party_template[role]; ++slot) {
+            double seconds = response(ready_check_rng);
+            int declined = chance(ready_check_rng) < ready_check_decline;
+            answers[role].push_back({seconds, declined});
+            if (seconds >= ready_check_timeout) fails_at = std::min(fails_at, ready_check_timeout);
+            else if (declined) fails_at = std::min(fails_at, seconds);
+            else all_accepted_at = std::max(all_accepted_at, seconds);
+        }
+    }
+
+    PendingReadyCheck check{};
+    check.reserved = now;
+    check.party = party;
+    check.ready = std::isinf(fails_at);
+    check.timed_out = fails_at >= ready_check_timeout;
+    double seconds = check.ready ? all_accepted_at : fails_at;
+    check.resolves = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(seconds));
+    // Each role's slots are its own-queue players, then flex players by
+    // bucket, then loans, so every member's answer maps to where they came from.
+    party->returning = sources;
+    for (int role = 0; role < ROLE_COUNT && !check.ready; ++role) {
+        size_t slot = 0;
+        auto returning_of = [&](long long members) {
+            long long back = 0;
+            for (size_t end = slot + static_cast<size_t>(members); slot < end; ++slot) {
+                // A decline leaves alone; on a timeout everyone still silent leaves.
+                const auto& [answered, declined] = answers[role][slot];
+                back += !(check.timed_out ? answered >= ready_check_timeout : declined && answered == fails_at);
+            }
+            check.returned[role] += back;
+            return back;
+        };
+        long long own = party_template[role];
+        for (const auto& bucket : sources.flex) own -= bucket[role];
+        for (const auto& loan : sources.loans) own -= loan.role == role ? loan.count : 0;
+        returning_of(own);
+        for (auto& bucket : party->returning.flex) bucket[role] = returning_of(bucket[role]);
+        for (auto& loan : party->returning.loans) {
+            if (loan.role == role) loan.count = returning_of(loan.count);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(ready_check_mutex);
+        ready_check_queue.push(check);
+    }
+    ready_check_cv.notify_one();
+}
+
+void ready_check_timer() {
+    std::unique_lock<std::mutex> lock(ready_check_mutex);
+    while (true) {
+        if (ready_check_queue.empty()) {
+            if (ready_check_stopping) return;
+            ready_check_cv.wait(lock);
+            continue;
+        }
+        PendingReadyCheck next = ready_check_queue.top();
+        if (ready_check_cv.wait_until(lock, next.resolves) != std::cv_status::timeout
+            && std::chrono::steady_clock::now() < next.resolves) {
+            continue;  // woken early: a sooner check may have been pushed
+        }
+        ready_check_queue.pop();
+        lock.unlock();
+        resolve_ready_check(next);
+        lock.lock();
+    }
+}
+
+// Starts the run, or frees the instance and returns the members who answered
+// to the front of the queues they came from: borrowed players to their donor
+// region, flex players to their flex bucket.
+void resolve_ready_check(const PendingReadyCheck& check) {
+    PartyRecord* party = check.party;
+    const int region_index = party->region;
+    const int instance_id = party->instance_id;
+    std::unique_lock<std::mutex> lock(g_mutex);
+    Region& region = regions[region_index];
+    DungeonInstance& instance = region.instances[instance_id];
+    auto now = std::chrono::steady_clock::now();
+    double held = std::chrono::duration<double>(now - check.reserved).count();
+    region.ready_check_seconds += held;
+
+    if (check.ready) {
+        instance.status = "active";
+        mark_status_changed(region_index, instance_id);
+        party->started = now;
+        launch_run(party);
+        publish_snapshot();
+        if (!workers.empty()) flush_worker_assignments(lock);
+        return;
+    }
+
+    account_idle_time(region, now);
+    long long returned = 0, members = 0;
+    long long own[ROLE_COUNT];
+    std::copy(std::begin(check.returned), std::end(check.returned), own);
+    const PartySources& returning = party->returning;
+    for (int mask = 0; mask < ROLE_MASKS; ++mask) {
+        long long players = 0;
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            players += returning.flex[mask][role];
+            own[role] -= returning.flex[mask][role];
+        }
+        requeue_flex_players_at_front(region, mask, players, now);
+    }
+    for (const auto& loan : returning.loans) {
+        if (loan.count == 0) continue;
+        Region& donor = regions[loan.region];
+        account_idle_time(donor, now);
+        requeue_players_at_front(donor, loan.role, loan.count, now);
+        record_role_event(EventType::PlayerQueued, donor, loan.role, loan.count, now);
+        own[loan.role] -= loan.count;
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        requeue_players_at_front(region, role, own[role], now);
+        returned += check.returned[role];
+        members += party_template[role];
+    }
+    region.failed_check_seconds += held;
+    (check.timed_out ? region.ready_checks_timed_out : region.ready_checks_declined)++;
+    region.players_returned += returned;
+    region.players_dropped += members - returned;
+    if (closed_population) {
+        long long leaving[ROLE_COUNT];
+        for (int role = 0; role < ROLE_COUNT; ++role) leaving[role] = party_template[role] - check.returned[role];
+        schedule_return(region_index, leaving, now);
+    }
+    party_records.release(party);
+    instance.party = nullptr;
+    instance.status = "empty";
+    mark_status_changed(region_index, instance_id);
+    release_instance(region, instance_id);
+    region.active_parties--;
+    active_parties--;
+    record_event(EventType::ReadyCheckFailed, region_index, instance_id, own, 0, now);
+
+    if (log_level >= LogLevel::Normal) {
+        std::stringstream ss;
+        ss << "Ready check failed on Instance " << instance_id << " ("
+           << (check.timed_out ? "a member did not answer" : "a member declined") << "). Returning "
+           << check.returned[ROLE_TANK] << "T, " << check.returned[ROLE_HEALER] << "H, " << check.returned[ROLE_DPS]
+           << "D to the front of the queue.";
+        log_message(region_thread_name("ReadyCheck", region_index), ss.str());
+    }
+    publish_snapshot();
+    lock.unlock();
+    note_wake_request();
+    cv.notify_all();
+}
+
+// Called with g_mutex held. A record costs no allocation once the pool and
+// the return queue have grown to the population's size.
+void schedule_return(int region_index, const long long* players, std::chrono::steady_clock::time_point now) {
+    long long total = 0;
+    for (int role = 0; role < ROLE_COUNT; ++role) total += players[role];
+    if (total == 0) return;
+    ReturningParty* party = returning_parties.acquire();
+    party->region = region_index;
+    std::copy(players, players + ROLE_COUNT, party->players);
+    return_queue.push({now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>(population_cooldown)),
+                       party});
+    players_cooling_down += total;
+}
+
+void take_population_baseline(std::chrono::steady_clock::time_point now) {
+    population_baseline = PopulationBaseline{};
+    population_baseline.taken = true;
+    population_baseline.at = std::chrono::duration<double>(now - start_time).count();
+    for (const auto& region : regions) {
+        population_baseline.parties_served += region.parties_served;
+        population_baseline.players_matched += region.players_matched;
+        population_baseline.total_wait_seconds += region.total_wait_seconds;
+    }
+}
+
+// Re-queues players whose cooldown is over, through the normal admission
+// path, and takes the steady-state baseline once the warm-up ends.
+void population_manager() {
+    const std::string thread_name = "Population";
+    const auto warmup_ends = start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                              std::chrono::duration<double>(population_warmup));
+    std::unique_lock<std::mutex> lock(g_mutex);
+    while (simulation_running) {
+        auto now = std::chrono::steady_clock::now();
+        if (!population_baseline.taken && now >= warmup_ends) take_population_baseline(now);
+
+        bool returned = false;
+        while (!return_queue.empty() && return_queue.top().at <= now) {
+            ReturningParty* party = return_queue.top().party;
+            return_queue.pop();
+            Region& region = regions[party->region];
+            std::stringstream report;
+            long long total = 0;
+            for (int role = 0; role < ROLE_COUNT; ++role) {
+                admit_players(region, role, party->players[role], now, report);
+                total += party->players[role];
+            }
+            players_cooling_down -= total;
+            population_returns += total;
+            if (log_level >= LogLevel::Normal) {
+                std::stringstream ss;
+                ss << party->players[ROLE_TANK] << "T, " << party->players[ROLE_HEALER] << "H, "
+                   << party->players[ROLE_DPS] << "D back in the queue after their cooldown";
+                if (regions.size() > 1) ss << " (" << region.name << ")";
+                ss << ".";
+                if (report.tellp() > 0) ss << " " << report.str();
+                log_message(thread_name, ss.str());
+            }
+            returning_parties.release(party);
+            returned = true;
+        }
+        if (returned) {
+            publish_snapshot();
+            lock.unlock();
+            note_wake_request();
+            cv.notify_all();
+            lock.lock();
+            continue;
+        }
+
+        auto next = return_queue.empty() ? std::chrono::steady_clock::time_point::max() : return_queue.top().at;
+        if (!population_baseline.taken) next = std::min(next, warmup_ends);
+        if (next == std::chrono::steady_clock::time_point::max()) cv.wait(lock);
+        else cv.wait_until(lock, next);
+    }
+}
+
+// Admits players for every region and role on its own thinned stream of the
+// role's profile, so arrivals follow the curve in (scaled) real time.
+void arrival_generator() {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    const std::string thread_name = "Arrivals";
+    struct Stream {
+        int region;
+        int role;
+        double next;  // profile seconds
+        std::mt19937_64 gen;
+    };
+    std::vector<Stream> streams;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            if (arrival_profiles[role].empty()) continue;
+            Stream stream{static_cast<int>(i), role, 0, std::mt19937_64(mix_seed(arrival_seed, i * ROLE_COUNT + role))};
+            stream.next = next_profile_arrival(arrival_profiles[role], 0, stream.gen);
+            streams.push_back(std::move(stream));
+        }
+    }
+    auto deadline = [](double profile_seconds) {
+        if (!std::isfinite(profile_seconds)) return std::chrono::steady_clock::time_point::max();
+        return start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double>(profile_seconds / profile_time_scale));
+    };
+    {
+        std::stringstream ss;
+        ss << "Arrival profile running at " << profile_time_scale << "x for";
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            if (!arrival_profiles[role].empty()) {
+                ss << " " << role_names[role] << " (mean " << profile_mean(arrival_profiles[role]) << "/s)";
+            }
+        }
+        ss << ".";
+        log_message(thread_name, ss.str());
+    }
+
+    std::unique_lock<std::mutex> lock(g_mutex);
+    while (simulation_running) {
+        auto now = std::chrono::steady_clock::now();
+        bool admitted = false;
+        for (auto& stream : streams) {
+            long long due = 0;
+            while (deadline(stream.next) <= now) {
+                ++due;
+                stream.next = next_profile_arrival(arrival_profiles[stream.role], stream.next, stream.gen);
+            }
+            if (due == 0) continue;
+            Region& region = regions[stream.region];
+            std::stringstream report;
+            if (admission_closed) {
+                report << "Draining: rejected.";
+                players_rejected = saturating_add(players_rejected, due);
+            } else {
+                admit_players(region, stream.role, due, now, report);
+            }
+            admitted = true;
+            if (log_level >= LogLevel::Verbose || report.tellp() > 0) {
+                std::stringstream ss;
+                ss << due << " " << role_names[stream.role] << "(s) arrived";
+                if (regions.size() > 1) ss << " (" << region.name << ")";
+                ss << ".";
+                if (report.tellp() > 0) ss << " " << report.str();
+                log_message(thread_name, ss.str());
+            }
+        }
+        if (admitted) {
+            publish_snapshot();
+            lock.unlock();
+            note_wake_request();
+            cv.notify_all();
+            lock.lock();
+            continue;
+        }
+
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (const auto& stream : streams) next = std::min(next, deadline(stream.next));
+        if (next == std::chrono::steady_clock::time_point::max()) cv.wait(lock);
+        else cv.wait_until(lock, next);
+    }
+}
+
+int begin_run(PartyRecord& party) {
+    party.duration = get_random_time() + party.extra_seconds;
+    if (log_level >= LogLevel::Normal) {
+        log_message(region_thread_name("DungeonRun", party.region) + "-" + std::to_string(party.instance_id),
+                    "Entering dungeon for " + std::to_string(party.duration) + "s.");
+    }
+    return party.duration;
+}
+
+void complete_run(int region_index, int instance_id, int time_in_dungeon) {
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        finish_run(region_index, instance_id, time_in_dungeon);
+        publish_snapshot();
+    }
+    
+    note_wake_request();
+    cv.notify_all();
+}
+
+// Called with g_mutex held.
+void finish_run(int region_index, int instance_id, int time_in_dungeon) {
+    Region& region = regions[region_index];
+    DungeonInstance& instance = region.instances[instance_id];
+    auto now = std::chrono::steady_clock::now();
+    account_idle_time(region, now);
+    if (instance.party) {
+        if (!timeline_path.empty()) record_busy_interval(instance, instance.party->started, now);
+        party_records.release(instance.party);
+    }
+    instance.party = nullptr;
+    instance.status = "empty";
+    mark_status_changed(region_index, instance_id);
+    rerank(region.by_parties, instance.parties_served, instance.parties_served + 1, instance_id);
+    rerank(region.by_time, instance.total_time_served, instance.total_time_served + time_in_dungeon, instance_id);
+    instance.parties_served++;
+    instance.total_time_served += time_in_dungeon;
+    release_instance(region, instance_id);
+    region.active_parties--;
+    active_parties--;
+    region.parties_served++;
+    region.total_time_served += time_in_dungeon;
+    record_event(EventType::RunCompleted, region_index, instance_id, nullptr, time_in_dungeon, now);
+    if (closed_population) {
+        long long players[ROLE_COUNT];
+        std::copy(std::begin(party_template), std::end(party_template), players);
+        schedule_return(region_index, players, now);
+    }
+
+    // Names and messages are only built when logged: quiet runs allocate nothing here.
+    if (log_level >= LogLevel::Normal) {
+        const std::string thread_name = region_thread_name("DungeonRun", region_index) + "-" + std::to_string(instance_id);
+        std::stringstream ss;
+        ss << "Instance " << instance_id << " is now free after " << time_in_dungeon << "s. "
+           << active_parties << " parties still active.";
+        log_message(thread_name, ss.str());
+        print_status(region, thread_name);
+    }
+}
+
+std::string region_thread_name(const char* base, int region_index) {
+    if (regions.size() < 2) return base;
+    return std::string(base) + "-" + regions[region_index].name;
+}
+
+// Region names are fixed before any input or control thread starts.
+int find_region(std::string_view name) {
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (regions[i].name == name) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+// Callers keep the amount within max_queue_size - queue[role].
+void enqueue_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now) {
+    if (amount <= 0) return;
+    account_idle_time(region, now);
+    region.queue[role] = saturating_add(region.queue[role], amount);
+    region.waiting[role].push_back({now, amount, region.arrivals[role]});
+    region.arrivals[role] += amount;
+    record_role_event(EventType::PlayerQueued, region, role, amount, now);
+}
+
+// Removes the longest-waiting players and accounts for their wait.
+void dequeue_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now) {
+    account_idle_time(region, now);
+    region.queue[role] -= amount;
+    region.players_matched = saturating_add(region.players_matched, amount);
+    auto& waiting = region.waiting[role];
+    while (amount > 0) {
+        QueuedBatch& oldest = waiting.front();
+        long long taken = std::min(amount, oldest.count);
+        region.total_wait_seconds += taken * std::chrono::duration<double>(now - oldest.since).count();
+        oldest.count -= taken;
+        oldest.first += taken;
+        amount -= taken;
+        if (oldest.count == 0) waiting.pop_front();
+    }
+}
+
+// Players whose ready check failed keep their place ahead of everyone who
+// queued after them. Their wait restarts; the attempt they left already
+// counted as a match. Capacity limits do not apply to returning players.
+void requeue_players_at_front(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now) {
+    if (amount <= 0) return;
+    region.queue[role] = saturating_add(region.queue[role], amount);
+    region.waiting[role].push_front({now, amount, region.arrivals[role]});
+    region.arrivals[role] += amount;
+}
+
+// The same for flex players, who keep every role they accepted.
+void requeue_flex_players_at_front(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now) {
+    if (amount <= 0) return;
+    region.flex[mask] = saturating_add(region.flex[mask], amount);
+    region.flex_waiting[mask].push_front({now, amount, 0});
+    const long long amounts[ROLE_COUNT] = {amount, 0, 0};
+    record_event(EventType::FlexQueued, static_cast<int>(&region - regions.data()), mask, amounts, 0, now);
+}
+
+// Admits an add under queue_capacity and admission_policy, describing any
+// players turned away or held back in `report`. Without a capacity only the
+// 64-bit counter limit applies, and overflow is rejected.
+void admit_players(Region& region, int role, long long amount, std::chrono::steady_clock::time_point now,
+                   std::ostream& report) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    if (amount <= 0) return;
+    bool bounded = queue_capacity[role] > 0;
+    long long capacity = bounded ? queue_capacity[role] : max_queue_size;
+    auto separate = [&report] {
+        if (report.tellp() > 0) report << " ";
+    };
+
+    if (bounded && admission_policy == AdmissionPolicy::Delay) {
+        long long held_before = region.backlog[role];
+        region.backlog[role] = saturating_add(region.backlog[role], amount);
+        region.backlog_waiting[role].push_back({now, amount, region.arrivals[role]});
+        region.arrivals[role] += amount;
+        admit_backlogs(now);
+        long long held = std::min(amount, region.backlog[role] - std::min(held_before, region.backlog[role]));
+        if (held > 0) {
+            region.players_delayed = saturating_add(region.players_delayed, held);
+            separate();
+            report << "Queue full: holding " << held << " " << role_names[role] << "(s) until there is room ("
+                   << region.backlog[role] << " waiting to enter).";
+        }
+        return;
+    }
+
+    long long room = capacity - region.queue[role];
+    long long excess = std::max(0LL, amount - room);
+    if (excess > 0 && bounded && admission_policy == AdmissionPolicy::DropOldest) {
+        // Newest players win: evict the queue's oldest, and if the add alone
+        // exceeds the capacity, its own earliest players too.
+        long long evicted = std::min(excess, region.queue[role]);
+        evict_oldest_players(region, role, evicted);
+        room += evicted;
+        region.evicted[role] = saturating_add(region.evicted[role], excess);
+        players_rejected = saturating_add(players_rejected, excess);
+        separate();
+        report << "Queue full: evicted " << excess << " oldest " << role_names[role] << "(s) at capacity " << capacity
+               << ".";
+    } else if (excess > 0) {
+        region.rejected[role] = saturating_add(region.rejected[role], excess);
+        players_rejected = saturating_add(players_rejected, excess);
+        separate();
+        report << "Queue full: rejected " << excess << " " << role_names[role] << "(s) above " << capacity << ".";
+    }
+    enqueue_players(region, role, std::min(amount, room), now);
+}
+
+// Moves held players into every region's queue as space allows, keeping
+// their arrival time so queue waits include the time spent held. Returns
+// whether anyone was admitted. Called with g_mutex held.
+bool admit_backlogs(std::chrono::steady_clock::time_point now) {
+    if (admission_policy != AdmissionPolicy::Delay) return false;
+    bool admitted = false;
+    for (auto& region : regions) {
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            auto& held = region.backlog_waiting[role];
+            long long room = (queue_capacity[role] > 0 ? queue_capacity[role] : max_queue_size) - region.queue[role];
+            while (room > 0 && !held.empty()) {
+                QueuedBatch& oldest = held.front();
+                long long taken = std::min(room, oldest.count);
+                account_idle_time(region, now);
+                region.queue[role] += taken;
+                region.waiting[role].push_back({oldest.since, taken, oldest.first});
+                record_role_event(EventType::PlayerQueued, region, role, taken, now);
+                region.backlog[role] -= taken;
+                region.admitted_from_backlog = saturating_add(region.admitted_from_backlog, taken);
+                region.total_admission_delay += taken * std::chrono::duration<double>(now - oldest.since).count();
+                room -= taken;
+                oldest.count -= taken;
+                oldest.first += taken;
+                if (oldest.count == 0) held.pop_front();
+                admitted = true;
+            }
+        }
+    }
+    if (admitted) cv.notify_all();  // other regions' formers may now have work
+    return admitted;
+}
+
+// Removes the longest-waiting players without matching them.
+void evict_oldest_players(Region& region, int role, long long amount) {
+    auto now = std::chrono::steady_clock::now();
+    account_idle_time(region, now);
+    record_role_event(EventType::PlayerEvicted, region, role, amount, now);
+    region.queue[role] -= amount;
+    auto& waiting = region.waiting[role];
+    while (amount > 0) {
+        QueuedBatch& oldest = waiting.front();
+        long long taken = std::min(amount, oldest.count);
+        oldest.count -= taken;
+        oldest.first += taken;
+        amount -= taken;
+        if (oldest.count == 0) waiting.pop_front();
+    }
+}
+
+bool can_form_party(const Region& region) {
+    return max_local_parties(region) >= 1;
+}
+
+// The most parties the region's own players can fill. By max-flow/min-cut on
+// the bipartite graph of player buckets and roles, k parties fit iff every
+// set of roles S gets k * need(S) from its single-role players plus the flex
+// players able to play any role in S, so k is the minimum over the 7 sets.
+long long max_local_parties(const Region& region) {
+    long long parties = std::numeric_limits<long long>::max();
+    for (int roles = 1; roles < ROLE_MASKS; ++roles) {
+        long long need = 0, supply = 0;
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            if (!(roles & (1 << role))) continue;
+            need += party_template[role];
+            supply = saturating_add(supply, region.queue[role]);
+        }
+        for (int mask = 0; mask < ROLE_MASKS; ++mask) {
+            if (mask & roles) supply = saturating_add(supply, region.flex[mask]);
+        }
+        if (need > 0) parties = std::min(parties, supply / need);
+    }
+    return parties;
+}
+
+// Fills what single-role players left short with flex players: a max-flow
+// from flex buckets to the short roles by shortest augmenting paths, so a
+// player already placed can be moved to another of their roles to make room.
+// Two-role buckets come before "any role" ones, keeping the most flexible
+// players for whichever role runs scarce next. deficit[] keeps what is left.
+void assign_flex_players(const Region& region, long long (&deficit)[ROLE_COUNT],
+                         long long (&taken)[ROLE_MASKS][ROLE_COUNT]) {
+    static constexpr int buckets[] = {0b011, 0b101, 0b110, 0b111};
+    constexpr int bucket_count = 4, source = 0, sink = 1 + bucket_count + ROLE_COUNT, nodes = sink + 1;
+    const long long unlimited = std::numeric_limits<long long>::max() / 4;
+    long long capacity[nodes][nodes] = {};
+    long long flow[nodes][nodes] = {};
+    for (int b = 0; b < bucket_count; ++b) {
+        capacity[source][1 + b] = region.flex[buckets[b]];
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            if (buckets[b] & (1 << role)) capacity[1 + b][1 + bucket_count + role] = unlimited;
+        }
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) capacity[1 + bucket_count + role][sink] = deficit[role];
+
+    while (true) {
+        int parent[nodes];
+        std::fill(std::begin(parent), std::end(parent), -1);
+        parent[source] = source;
+        int queue[nodes], head = 0, tail = 0;
+        queue[tail++] = source;
+        while (head < tail && parent[sink] < 0) {
+            int u = queue[head++];
+            for (int v = 0; v < nodes; ++v) {
+                if (parent[v] < 0 && capacity[u][v] - flow[u][v] > 0) {
+                    parent[v] = u;
+                    queue[tail++] = v;
+                }
+            }
+        }
+        if (parent[sink] < 0) break;
+        long long push = unlimited;
+        for (int v = sink; v != source; v = parent[v]) push = std::min(push, capacity[parent[v]][v] - flow[parent[v]][v]);
+        for (int v = sink; v != source; v = parent[v]) {
+            flow[parent[v]][v] += push;
+            flow[v][parent[v]] -= push;
+        }
+    }
+    for (int b = 0; b < bucket_count; ++b) {
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            long long placed = std::max(0LL, flow[1 + b][1 + bucket_count + role]);
+            taken[buckets[b]][role] = placed;
+            deficit[role] -= placed;
+        }
+    }
+}
+
+void enqueue_flex_players(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now) {
+    if (amount <= 0) return;
+    account_idle_time(region, now);
+    region.flex[mask] = saturating_add(region.flex[mask], amount);
+    region.flex_waiting[mask].push_back({now, amount, 0});
+    const long long amounts[ROLE_COUNT] = {amount, 0, 0};
+    record_event(EventType::FlexQueued, static_cast<int>(&region - regions.data()), mask, amounts, 0, now);
+}
+
+void dequeue_flex_players(Region& region, int mask, long long amount, std::chrono::steady_clock::time_point now) {
+    account_idle_time(region, now);
+    region.flex[mask] -= amount;
+    region.players_matched = saturating_add(region.players_matched, amount);
+    auto& waiting = region.flex_waiting[mask];
+    while (amount > 0) {
+        QueuedBatch& oldest = waiting.front();
+        long long taken = std::min(amount, oldest.count);
+        region.total_wait_seconds += taken * std::chrono::duration<double>(now - oldest.since).count();
+        oldest.count -= taken;
+        amount -= taken;
+        if (oldest.count == 0) waiting.pop_front();
+    }
+}
+
+std::string role_mask_name(int mask) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    std::string name;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (!(mask & (1 << role))) continue;
+        if (!name.empty()) name += "/";
+        name += role_names[role];
+    }
+    return name;
+}
+
+// True when someone is waiting here and the other regions' single-role
+// players cover every role this region's own players, flex included, leave
+// short -- the same split form_party() makes.
+bool can_borrow_party(const Region& region) {
+    if (overflow_after <= 0 || regions.size() < 2) return false;
+    auto empty = [](long long queued) { return queued == 0; };
+    if (std::all_of(std::begin(region.queue), std::end(region.queue), empty)
+        && std::all_of(std::begin(region.flex), std::end(region.flex), empty)) {
+        return false;
+    }
+    long long short_of[ROLE_COUNT];
+    long long from_flex[ROLE_MASKS][ROLE_COUNT] = {};
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        short_of[role] = std::max(0LL, party_template[role] - region.queue[role]);
+    }
+    assign_flex_players(region, short_of, from_flex);
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        long long missing = short_of[role];
+        for (size_t i = 0; i < regions.size() && missing > 0; ++i) {
+            if (&regions[i] != &region) missing -= regions[i].queue[role];
+        }
+        if (missing > 0) return false;
+    }
+    return true;
+}
+
+// When the region's oldest waiting player becomes eligible for a
+// cross-region party, or nullopt if no such party could be formed.
+std::optional<std::chrono::steady_clock::time_point> overflow_deadline(const Region& region) {
+    if (!can_borrow_party(region)) return std::nullopt;
+    auto oldest = std::chrono::steady_clock::time_point::max();
+    for (const auto& waiting : region.waiting) {
+        if (!waiting.empty()) oldest = std::min(oldest, waiting.front().since);
+    }
+    for (const auto& waiting : region.flex_waiting) {
+        if (!waiting.empty()) oldest = std::min(oldest, waiting.front().since);
+    }
+    return oldest + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(overflow_after));
+}
+
+// Where the next party can go: a free instance, or with staging a free slot
+// in the staging queue.
+long long formation_slots(const Region& region) {
+    if (staging_capacity > 0) return staging_capacity - static_cast<long long>(region.staged_count);
+    return region.free_instance_count;
+}
+
+// Parties the region could form from its own queues, capped by formation slots.
+long long formable_parties(const Region& region) {
+    return std::min<long long>(formation_slots(region), max_local_parties(region));
+}
+
+// Opens the region's batching window when a local party first becomes
+// formable. The batch is due once the window runs out or it is full.
+bool batch_due(Region& region, std::chrono::steady_clock::time_point now) {
+    if (batch_window <= 0) return true;
+    if (!region.batch_opened) region.batch_opened = now;
+    long long full = formation_slots(region);
+    if (batch_max_parties > 0) full = std::min<long long>(full, batch_max_parties);
+    return *batch_deadline(region) <= now || formable_parties(region) >= full;
+}
+
+std::optional<std::chrono::steady_clock::time_point> batch_deadline(const Region& region) {
+    if (batch_window <= 0 || !region.batch_opened) return std::nullopt;
+    return *region.batch_opened + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                      std::chrono::duration<double>(batch_window));
+}
+
+// Skill ratings in [1000, 2000), a pure function of the player's arrival, so
+// immediate and batched runs with one seed match the same population.
+int player_rating(int region_index, int role, long long arrival) {
+    unsigned long long stream = mix_seed(rating_seed, static_cast<unsigned long long>(region_index * ROLE_COUNT + role));
+    return 1000 + static_cast<int>(mix_seed(stream, static_cast<unsigned long long>(arrival)) % 1000);
+}
+
+bool has_free_instance(const Region& region) {
+    return region.free_instance_count > 0;
+}
+
+int acquire_free_instance(Region& region) {
+    while (true) {
+        int id = region.selector->acquire();
+        if (id < 0) return -1;
+        region.instances[id].pooled = false;
+        if (id < region.instance_limit) {
+            region.free_instance_count--;
+            return id;
+        }
+    }
+}
+
+// Called when a run completes; retired instances stay out of the pool.
+void release_instance(Region& region, int instance_id) {
+    if (instance_id >= region.instance_limit) return;
+    region.instances[instance_id].pooled = true;
+    region.selector->release(instance_id);
+    region.free_instance_count++;
+}
+
+// Grows or shrinks the usable range [0, new_limit). Instances above the new
+// limit finish their current run and are then left out of the pool.
+void resize_instance_pool(Region& region, int new_limit) {
+    account_idle_time(region, std::chrono::steady_clock::now());
+    auto& instances = region.instances;
+    while (static_cast<int>(instances.size()) < new_limit) {
+        int id = static_cast<int>(instances.size());
+        instances.emplace_back(id);
+        region.by_parties.insert({0, id});
+        region.by_time.insert({0, id});
+    }
+    region.instance_limit = new_limit;
+    record_event(EventType::InstancesScaled, static_cast<int>(&region - regions.data()), new_limit, nullptr, 0,
+                 std::chrono::steady_clock::now());
+    region.free_instance_count = 0;
+    for (int i = 0; i < region.instance_limit; ++i) {
+        if (instances[i].status != "empty") continue;
+        if (!instances[i].pooled) {
+            instances[i].pooled = true;
+            region.selector->release(i);
+        }
+        region.free_instance_count++;
+    }
+}
+
+// --- Event Stream ---
+
+// Called with g_mutex held, so seq order is the order the state changed in.
+void record_event(EventType type, int region_index, int value, const long long* amounts, int duration,
+                  std::chrono::steady_clock::time_point when) {
+    SimEvent event{type, region_index, value, duration, {0, 0, 0},
+                   std::chrono::duration<double>(when - start_time).count(), ++event_seq};
+    if (amounts) std::copy(amounts, amounts + ROLE_COUNT, event.amounts);
+    event_buffer.push_back(event);
+}
+
+void record_role_event(EventType type, const Region& region, int role, long long amount,
+                       std::chrono::steady_clock::time_point when) {
+    long long amounts[ROLE_COUNT] = {0, 0, 0};
+    amounts[role] = amount;
+    record_event(type, static_cast<int>(&region - regions.data()), -1, amounts, 0, when);
+}
+
+// The reducer shared by the live journal and --replay.
+void fold_event(EventState& state, const SimEvent& event) {
+    if (event.region < 0) return;
+    if (static_cast<size_t>(event.region) >= state.regions.size()) state.regions.resize(event.region + 1);
+    EventState::RegionState& region = state.regions[event.region];
+    auto mark = [&region](int instance, char active) {
+        if (instance < 0) return;
+        if (static_cast<size_t>(instance) >= region.active.size()) region.active.resize(instance + 1, 0);
+        region.active[instance] = active;
+    };
+    switch (event.type) {
+    case EventType::PlayerQueued:
+        for (int role = 0; role < ROLE_COUNT; ++role) region.queue[role] += event.amounts[role];
+        break;
+    case EventType::PlayerEvicted:
+    case EventType::PlayersBorrowed:
+        for (int role = 0; role < ROLE_COUNT; ++role) region.queue[role] -= event.amounts[role];
+        break;
+    case EventType::PartyFormed:
+        for (int role = 0; role < ROLE_COUNT; ++role) region.queue[role] -= event.amounts[role];
+        region.parties_formed++;
+        if (event.value >= 0) {
+            mark(event.value, 1);
+            region.active_parties++;
+        } else {
+            region.staged++;  // PartyDispatched follows
+        }
+        break;
+    case EventType::PartyDispatched:
+        mark(event.value, 1);
+        region.active_parties++;
+        region.staged--;
+        break;
+    case EventType::ReadyCheckFailed:
+        for (int role = 0; role < ROLE_COUNT; ++role) region.queue[role] += event.amounts[role];
+        mark(event.value, 0);
+        region.active_parties--;
+        break;
+    case EventType::RunCompleted:
+        mark(event.value, 0);
+        region.active_parties--;
+        region.parties_served++;
+        region.total_time_served += event.duration;
+        break;
+    case EventType::InstancesScaled:
+        region.instance_limit = event.value;
+        break;
+    case EventType::FlexQueued:
+        if (event.value > 0 && event.value < ROLE_MASKS) region.flex[event.value] += event.amounts[0];
+        break;
+    case EventType::FlexMatched:
+        if (event.value <= 0 || event.value >= ROLE_MASKS) break;
+        for (int role = 0; role < ROLE_COUNT; ++role) region.flex[event.value] -= event.amounts[role];
+        break;
+    }
+    state.seq = event.seq;
+}
+
+// Journal lines are "<type> <seq> <seconds> <region>" followed by the
+// instance and/or t h d amounts, the duration or the limit. A header names
+// the regions, and a "K" line checkpoints the whole folded state.
+bool open_event_journal(const std::string& path) {
+    event_journal_file = std::fopen(path.c_str(), "w");
+    if (!event_journal_file) return false;
+    std::fprintf(event_journal_file, "H %zu", regions.size());
+    for (const auto& region : regions) std::fprintf(event_journal_file, " %s", region.name.empty() ? "-" : region.name.c_str());
+    std::fputc('\n', event_journal_file);
+    std::fflush(event_journal_file);  // forked workers must not inherit buffered output
+    return true;
+}
+
+void write_event(std::FILE* out, const SimEvent& event) {
+    const long long* a = event.amounts;
+    switch (event.type) {
+    case EventType::PartyFormed:
+    case EventType::ReadyCheckFailed:
+    case EventType::FlexMatched:
+        std::fprintf(out, "%c %llu %.6f %d %d %lld %lld %lld\n", static_cast<char>(event.type), event.seq, event.at,
+                     event.region, event.value, a[0], a[1], a[2]);
+        break;
+    case EventType::RunCompleted:
+        std::fprintf(out, "C %llu %.6f %d %d %d\n", event.seq, event.at, event.region, event.value, event.duration);
+        break;
+    case EventType::InstancesScaled:
+    case EventType::PartyDispatched:
+        std::fprintf(out, "%c %llu %.6f %d %d\n", static_cast<char>(event.type), event.seq, event.at, event.region,
+                     event.value);
+        break;
+    case EventType::FlexQueued:
+        std::fprintf(out, "X %llu %.6f %d %d %lld\n", event.seq, event.at, event.region, event.value, a[0]);
+        break;
+    default:
+        std::fprintf(out, "%c %llu %.6f %d %lld %lld %lld\n", static_cast<char>(event.type), event.seq, event.at,
+                     event.region, a[0], a[1], a[2]);
+        break;
+    }
+}
+
+void write_checkpoint(std::FILE* out, const EventState& state, double at) {
+    std::fprintf(out, "K %llu %.6f %zu", state.seq, at, state.regions.size());
+    for (const auto& region : state.regions) {
+        long long active = std::count(region.active.begin(), region.active.end(), 1);
+        std::fprintf(out, " %d %lld %lld %lld %lld %lld %lld %lld %lld", region.instance_limit, region.queue[0],
+                     region.queue[1], region.queue[2], region.parties_formed, region.parties_served,
+                     region.total_time_served, region.staged, active);
+        for (long long flex : region.flex) std::fprintf(out, " %lld", flex);
+        for (size_t i = 0; i < region.active.size(); ++i) {
+            if (region.active[i]) std::fprintf(out, " %zu", i);
+        }
+    }
+    std::fputc('\n', out);
+}
+
+// Swaps the buffer out under g_mutex every 50 ms, then folds and writes the
+// batch without holding it.
+void event_journal() {
+    std::vector<SimEvent> drained;
+    unsigned long long since_checkpoint = 0;
+    while (true) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(journal_mutex);
+            journal_cv.wait_for(lock, std::chrono::milliseconds(50), [] { return journal_stopping; });
+            stopping = journal_stopping;
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            drained.swap(event_buffer);
+        }
+        for (const SimEvent& event : drained) {
+            fold_event(event_state, event);
+            if (!event_journal_file) continue;
+            write_event(event_journal_file, event);
+            if (event_checkpoint_every > 0 && ++since_checkpoint >= static_cast<unsigned long long>(event_checkpoint_every)) {
+                write_checkpoint(event_journal_file, event_state, event.at);
+                since_checkpoint = 0;
+            }
+        }
+        events_folded += drained.size();
+        drained.clear();  // keeps its capacity for the next swap
+        if (stopping) break;
+    }
+    if (event_journal_file) {
+        std::fclose(event_journal_file);
+        event_journal_file = nullptr;
+    }
+}
+
+// Compares the state folded from the stream with the live state, once every
+// thread has stopped.
+std::string verify_event_state() {
+    std::stringstream ss;
+    ss << "Event stream: " << event_state.seq << " events";
+    for (size_t i = 0; i < regions.size(); ++i) {
+        const Region& live = regions[i];
+        EventState::RegionState derived;
+        if (i < event_state.regions.size()) derived = event_state.regions[i];
+        bool same = derived.instance_limit == live.instance_limit && derived.active_parties == live.active_parties
+                    && derived.parties_formed == live.parties_formed && derived.parties_served == live.parties_served
+                    && derived.total_time_served == live.total_time_served
+                    && std::equal(std::begin(derived.queue), std::end(derived.queue), std::begin(live.queue))
+                    && std::equal(std::begin(derived.flex), std::end(derived.flex), std::begin(live.flex));
+        if (!same) {
+            ss << "; derived state differs from the live state" << (regions.size() > 1 ? " in region " + live.name : "");
+            return ss.str();
+        }
+    }
+    ss << "; derived state matches the live state.";
+    return ss.str();
+}
+
+// Folds a journal from its last checkpoint at or before `until`, so a long
+// run need not be replayed from the start, and prints the derived state.
+int replay_events(const std::string& path, std::optional<double> until) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open event log '" << path << "'.\n";
+        return 1;
+    }
+    std::vector<std::string> names;
+    EventState state;
+    unsigned long long checkpoint = 0, replayed = 0;
+    double last = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        char type = 0;
+        fields >> type;
+        if (type == 'H') {
+            size_t count = 0;
+            fields >> count;
+            names.resize(count);
+            for (auto& name : names) fields >> name;
+            continue;
+        }
+        SimEvent event{};
+        fields >> event.seq >> event.at;
+        if (!fields || (until && event.at > *until)) break;
+        if (type == 'K') {
+            size_t count = 0;
+            fields >> count;
+            state = EventState{};
+            state.seq = event.seq;
+            state.regions.resize(count);
+            for (auto& region : state.regions) {
+                long long active = 0;
+                fields >> region.instance_limit >> region.queue[0] >> region.queue[1] >> region.queue[2]
+                    >> region.parties_formed >> region.parties_served >> region.total_time_served >> region.staged
+                    >> active;
+                region.active_parties = active;
+                for (long long& flex : region.flex) fields >> flex;
+                for (long long i = 0; i < active; ++i) {
+                    size_t id = 0;
+                    fields >> id;
+                    if (id >= region.active.size()) region.active.resize(id + 1, 0);
+                    region.active[id] = 1;
+                }
+            }
+            checkpoint = event.seq;
+            replayed = 0;
+        } else {
+            event.type = static_cast<EventType>(type);
+            fields >> event.region;
+            if (type == 'F' || type == 'C' || type == 'S' || type == 'D' || type == 'R' || type == 'X' || type == 'M') {
+                fields >> event.value;
+            }
+            if (type == 'C') fields >> event.duration;
+            else if (type == 'X') fields >> event.amounts[0];
+            else if (type != 'S' && type != 'D') fields >> event.amounts[0] >> event.amounts[1] >> event.amounts[2];
+            if (!fields) {
+                std::cerr << "Malformed event line: " << line << "\n";
+                return 1;
+            }
+            fold_event(state, event);
+            replayed++;
+        }
+        last = event.at;
+    }
+
+    std::cout << "Replayed " << replayed << " events";
+    if (checkpoint) std::cout << " after the checkpoint at event " << checkpoint;
+    std::cout << " (state at event " << state.seq << ", " << std::fixed << std::setprecision(3) << last << "s)\n";
+    for (size_t i = 0; i < state.regions.size(); ++i) {
+        const EventState::RegionState& region = state.regions[i];
+        std::string name = i < names.size() && names[i] != "-" ? names[i] : "";
+        std::cout << (name.empty() ? "Queue " : "Region " + name + ": Queue ") << region.queue[ROLE_TANK] << "T, "
+                  << region.queue[ROLE_HEALER] << "H, " << region.queue[ROLE_DPS] << "D | Instances "
+                  << region.active_parties << " active of " << region.instance_limit << " | "
+                  << region.parties_formed << " formed, " << region.parties_served << " served, "
+                  << region.total_time_served << "s total run time";
+        if (region.staged > 0) std::cout << ", " << region.staged << " staged";
+        long long flex = std::accumulate(std::begin(region.flex), std::end(region.flex), 0LL);
+        if (flex > 0) {
+            std::cout << " | Flex";
+            for (int mask = 1; mask < ROLE_MASKS; ++mask) {
+                if (region.flex[mask] > 0) std::cout << " " << region.flex[mask] << " " << role_mask_name(mask);
+            }
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+// Charges the time since the last change to the state the region was in:
+// free instances idle for lack of a role or of any players, or a formable
+// party waiting for an instance. Called before each change, with g_mutex held.
+void account_idle_time(Region& region, std::chrono::steady_clock::time_point now) {
+    if (now <= region.accounted_until) return;
+    double elapsed = std::chrono::duration<double>(now - region.accounted_until).count();
+    region.accounted_until = now;
+    bool party_waiting = region.staged_count > 0 || can_form_party(region);
+    if (region.free_instance_count == 0) {
+        if (party_waiting) region.capacity_limited_seconds += elapsed;
+        return;
+    }
+    double idle = elapsed * region.free_instance_count;
+    if (party_waiting) region.idle_held_seconds += idle;
+    else if (std::any_of(std::begin(region.queue), std::end(region.queue), [](long long queued) { return queued > 0; }))
+        region.idle_starved_seconds += idle;
+    else region.idle_empty_seconds += idle;
+}
+
+namespace {
+void append_varint(std::vector<unsigned char>& out, unsigned long long value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+unsigned long long read_varint(const unsigned char*& in) {
+    unsigned long long value = 0;
+    for (int shift = 0;; shift += 7) {
+        unsigned char byte = *in++;
+        value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+} // namespace
+
+// Most gaps and runs fit in two or three varint bytes each, so an interval
+// costs about 5 bytes instead of two 8-byte timestamps.
+void record_busy_interval(DungeonInstance& instance, std::chrono::steady_clock::time_point started,
+                          std::chrono::steady_clock::time_point ended) {
+    auto to_ms = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t - start_time).count();
+    };
+    long long begin = std::max<long long>(to_ms(started), instance.timeline_end_ms);
+    long long end = std::max<long long>(to_ms(ended), begin);
+    append_varint(instance.timeline, static_cast<unsigned long long>(begin - instance.timeline_end_ms));
+    append_varint(instance.timeline, static_cast<unsigned long long>(end - begin));
+    instance.timeline_end_ms = end;
+    instance.timeline_intervals++;
+}
+
+// One row per instance (regions in order), one column per time bucket, each
+// cell the fraction of the bucket the instance was busy. A .pgm path gets a
+// greyscale image (black = busy); anything else gets CSV percentages.
+bool export_timeline(const std::string& path, int buckets, double uptime) {
+    std::ofstream out(path);
+    if (!out) return false;
+    double width_ms = std::max(1.0, uptime * 1000.0 / buckets);
+    size_t rows = 0;
+    for (const auto& region : regions) rows += region.instances.size();
+    bool image = path.size() >= 4 && path.compare(path.size() - 4, 4, ".pgm") == 0;
+    if (image) {
+        out << "P2\n" << buckets << " " << rows << "\n255\n";
+    } else {
+        out << "region,instance";
+        for (int b = 0; b < buckets; ++b) out << "," << std::fixed << std::setprecision(3) << b * width_ms / 1000.0;
+        out << "\n";
+    }
+    std::vector<double> busy(buckets);
+    for (const auto& region : regions) {
+        for (const auto& instance : region.instances) {
+            std::fill(busy.begin(), busy.end(), 0.0);
+            const unsigned char* cursor = instance.timeline.data();
+            long long end = 0;
+            for (long long i = 0; i < instance.timeline_intervals; ++i) {
+                long long begin = end + static_cast<long long>(read_varint(cursor));
+                end = begin + static_cast<long long>(read_varint(cursor));
+                for (int b = std::min(buckets - 1, static_cast<int>(begin / width_ms)); b < buckets && b * width_ms < end; ++b) {
+                    double overlap = std::min<double>(end, (b + 1) * width_ms) - std::max<double>(begin, b * width_ms);
+                    if (overlap > 0) busy[b] += overlap / width_ms;
+                }
+            }
+            if (!image) out << (region.name.empty() ? "-" : region.name) << "," << instance.id;
+            for (int b = 0; b < buckets; ++b) {
+                double fraction = std::min(1.0, busy[b]);
+                if (image) out << (b ? " " : "") << static_cast<int>(std::lround(255 * (1.0 - fraction)));
+                else out << "," << std::setprecision(1) << 100.0 * fraction;
+            }
+            out << "\n";
+        }
+    }
+    return static_cast<bool>(out);
+}
+
+// Moves the node rather than reallocating it, so completions stay allocation-free.
+void rerank(std::set<std::pair<long long, int>>& ranks, long long before, long long after, int id) {
+    auto node = ranks.extract({before, id});
+    node.value().first = after;
+    ranks.insert(std::move(node));
+}
+
+std::unique_ptr<InstanceSelector> make_instance_selector(InstancePolicy policy, unsigned long long seed,
+                                                         const std::vector<DungeonInstance>& instances) {
+    switch (policy) {
+    case InstancePolicy::RoundRobin: return std::make_unique<RoundRobinSelector>();
+    case InstancePolicy::LeastRecentlyUsed: return std::make_unique<LeastRecentlyUsedSelector>();
+    case InstancePolicy::LeastTotalTime: return std::make_unique<LeastTotalTimeSelector>(instances);
+    case InstancePolicy::Random: return std::make_unique<RandomSelector>(seed);
+    case InstancePolicy::FirstFree: break;
+    }
+    return std::make_unique<FirstFreeSelector>();
+}
+
+// Blocks until some input is available and returns what has arrived, up to
+// size bytes; 0 at end of input, on error, or once shutdown is requested.
+size_t read_available_input(char* data, size_t size) {
+    while (true) {
+#ifdef _WIN32
+        int count = _read(_fileno(stdin), data, static_cast<unsigned int>(size));
+#else
+        pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {shutdown_pipe[0], POLLIN, 0}};
+        if (poll(fds, shutdown_pipe[0] >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        if (fds[1].revents & POLLIN) return 0;
+        ssize_t count = read(STDIN_FILENO, data, size);
+#endif
+        if (count >= 0) return static_cast<size_t>(count);
+        if (errno != EINTR) return 0;
+    }
+}
+
+// One line of terminal input without its newline; bytes read past it stay in
+// pending. False at end of input or shutdown.
+bool read_input_line(std::string& pending, std::string& line) {
+    char buffer[4096];
+    size_t newline;
+    while ((newline = pending.find('\n')) == std::string::npos) {
+        size_t count = read_available_input(buffer, sizeof(buffer));
+        if (count == 0) {
+            if (pending.empty() || !simulation_running) return false;
+            line = std::move(pending);
+            pending.clear();
+            return true;
+        }
+        pending.append(buffer, count);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    return true;
+}
+
+bool stdin_is_terminal() {
+#ifdef _WIN32
+    return _isatty(_fileno(stdin)) != 0;
+#else
+    return isatty(fileno(stdin)) != 0;
+#endif
+}
+
+// --- NUMA Placement ---
+
+// CPUs of each online node from sysfs, or empty where that is unavailable.
+std::vector<std::vector<int>> detect_numa_nodes() {
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    for (int node = 0;; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!file || !std::getline(file, list)) break;
+        std::vector<int> cpus;
+        if (parse_cpu_list(trim(list), cpus) && !cpus.empty()) nodes.push_back(std::move(cpus));
+    }
+#endif
+    return nodes;
+}
+
+// "0-3,8,10-11", the sysfs cpulist format.
+bool parse_cpu_list(std::string_view list, std::vector<int>& cpus) {
+    cpus.clear();
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        size_t dash = range.find('-');
+        int first, last;
+        if (!parse_number(range.substr(0, dash), first)) return false;
+        last = first;
+        if (dash != std::string_view::npos && !parse_number(range.substr(dash + 1), last)) return false;
+        if (first < 0 || last < first || last >= 4096) return false;
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return true;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+// Pins the calling thread and sets its scheduling policy. A former gets the
+// single CPU cpus[former_index % size]; other threads (former_index < 0) get
+// the whole set. Real-time policies usually need CAP_SYS_NICE.
+bool apply_thread_placement(const ThreadPlacement& placement, int former_index, std::string& error) {
+    if (!placement.cpus.empty()) {
+        std::vector<int> cpus = placement.cpus;
+        if (former_index >= 0) cpus = {placement.cpus[former_index % placement.cpus.size()]};
+        if (!pin_current_thread(cpus)) error = "could not set CPU affinity";
+    }
+    if (placement.policy == SchedulingPolicy::Default) return error.empty();
+#ifdef __linux__
+    if (placement.policy == SchedulingPolicy::Other) {
+        sched_param param{};
+        if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) != 0
+            || setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), placement.priority) != 0) {
+            error += (error.empty() ? "" : "; ") + std::string("could not set nice value");
+        }
+    } else {
+        sched_param param{};
+        param.sched_priority = placement.priority;
+        int policy = placement.policy == SchedulingPolicy::Fifo ? SCHED_FIFO : SCHED_RR;
+        if (pthread_setschedparam(pthread_self(), policy, &param) != 0) {
+            error += (error.empty() ? "" : "; ") + std::string("could not set real-time policy (needs privileges)");
+        }
+    }
+#else
+    error += (error.empty() ? "" : "; ") + std::string("scheduling policies are not supported on this platform");
+#endif
+    return error.empty();
+}
+
+// Dungeon-run, timer and worker-link threads: explicit placement wins over
+// NUMA homing. Failures are reported once, not once per run.
+void place_worker_thread(const std::string& thread_name, int region_index) {
+    std::string error;
+    if (!worker_placement.cpus.empty() || worker_placement.policy != SchedulingPolicy::Default) {
+        if (worker_placement.cpus.empty() && region_index >= 0 && regions[region_index].node >= 0) {
+            pin_current_thread(numa_nodes[regions[region_index].node]);
+        }
+        apply_thread_placement(worker_placement, -1, error);
+    } else if (region_index >= 0 && regions[region_index].node >= 0) {
+        pin_current_thread(numa_nodes[regions[region_index].node]);
+    }
+    static std::atomic<bool> reported(false);
+    if (!error.empty() && !reported.exchange(true)) log_message(thread_name, "Worker placement: " + error + ".");
+}
+
+void note_wake_request() {
+    wake_requested_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+}
+
+// Copies the pool into memory first touched by the calling (node-pinned)
+// former, so the instance records live on the region's node. The vector
+// object itself stays put, so selectors keep their reference. g_mutex held.
+void rehome_instances(Region& region) {
+    std::vector<DungeonInstance> local;
+    local.reserve(region.instances.capacity());
+    local.assign(region.instances.begin(), region.instances.end());
+    region.instances.swap(local);
+    region.homed_instances = region.instances.data();
+}
+
+// Times instance-record updates (the completion path's writes) from a thread
+// on each node against records first-touched on each node.
+int run_numa_benchmark() {
+    std::vector<std::vector<int>> nodes = detect_numa_nodes();
+    if (nodes.empty()) {
+        std::cout << "NUMA topology unavailable on this system.\n";
+        return 1;
+    }
+    constexpr size_t record_count = 1 << 20;  // about the pool of a very large n
+    constexpr long long updates = 1 << 24;
+    std::cout << "NUMA benchmark: " << nodes.size() << " node(s), " << record_count << " instance records, "
+              << updates << " random updates per cell\n";
+
+    std::vector<std::vector<double>> ns_per_update(nodes.size(), std::vector<double>(nodes.size()));
+    for (size_t home = 0; home < nodes.size(); ++home) {
+        std::vector<DungeonInstance> records;
+        std::thread([&] {
+            pin_current_thread(nodes[home]);
+            records.reserve(record_count);
+            for (size_t i = 0; i < record_count; ++i) records.emplace_back(static_cast<int>(i));
+        }).join();
+
+        for (size_t worker = 0; worker < nodes.size(); ++worker) {
+            std::thread([&] {
+                pin_current_thread(nodes[worker]);
+                std::mt19937_64 gen(42);
+                auto begin = std::chrono::steady_clock::now();
+                for (long long i = 0; i < updates; ++i) {
+                    DungeonInstance& record = records[gen() % record_count];
+                    record.parties_served++;
+                    record.total_time_served += i & 15;
+                }
+                auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin);
+                ns_per_update[home][worker] = elapsed.count() / updates;
+            }).join();
+        }
+    }
+
+    double local = 0, remote = 0;
+    std::cout << std::fixed << std::setprecision(2) << "ns/update (rows: memory node, columns: thread node)\n";
+    for (size_t home = 0; home < nodes.size(); ++home) {
+        std::cout << "  node " << home << ":";
+        for (size_t worker = 0; worker < nodes.size(); ++worker) {
+            std::cout << " " << std::setw(8) << ns_per_update[home][worker];
+            (home == worker ? local : remote) += ns_per_update[home][worker];
+        }
+        std::cout << "\n";
+    }
+    local /= nodes.size();
+    std::cout << "Node-local: " << local << " ns/update";
+    if (nodes.size() > 1) {
+        remote /= nodes.size() * (nodes.size() - 1);
+        std::cout << " | Cross-node: " << remote << " ns/update | Homing saves "
+                  << (remote > 0 ? 100.0 * (remote - local) / remote : 0.0) << "% per update";
+    } else {
+        std::cout << " | Only one node: there is no cross-node traffic to remove";
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+bool is_simulation_idle() {
+    if (active_parties > 0 || staged_parties > 0) return false;
+    if (formation_paused) return true;
+    return std::none_of(regions.begin(), regions.end(), [](const Region& region) {
+        return region.instance_limit > 0 && (can_form_party(region) || can_borrow_party(region));
+    });
+}
+
+void print_status(const Region& region, const std::string& thread_name) {
+    if (log_level < LogLevel::Verbose) return;
+    for (const auto& instance : region.instances) {
+        std::stringstream ss;
+        ss << "  Instance " << instance.id << ": " << instance.status;
+        log_message(thread_name, ss.str());
+    }
+}
+// --- Capacity Planning ---
+
+// Exact probability of each integer run time that get_random_time() produces.
+std::vector<double> duration_pmf(DurationDistribution distribution, int lo, int hi) {
+    int span = hi - lo;
+    std::vector<double> pmf(span + 1, 0.0);
+    if (span == 0) {
+        pmf[0] = 1.0;
+        return pmf;
+    }
+
+    switch (distribution) {
+    case DurationDistribution::Uniform:
+        std::fill(pmf.begin(), pmf.end(), 1.0 / (span + 1));
+        break;
+    case DurationDistribution::Exponential: {
+        double mean = span / 2.0;
+        auto cdf = [mean](double x) { return x <= 0 ? 0.0 : 1.0 - std::exp(-x / mean); };
+        for (int j = 0; j < span; ++j) pmf[j] = cdf(j + 0.5) - cdf(j - 0.5);
+        pmf[span] = 1.0 - cdf(span - 0.5);
+        break;
+    }
+    case DurationDistribution::Normal: {
+        double mean = (lo + hi) / 2.0, sd = span / 6.0;
+        auto cdf = [mean, sd](double x) { return 0.5 * std::erfc(-(x - mean) / (sd * std::sqrt(2.0))); };
+        pmf[0] = cdf(lo + 0.5);
+        for (int j = 1; j < span; ++j) pmf[j] = cdf(lo + j + 0.5) - cdf(lo + j - 0.5);
+        pmf[span] = 1.0 - cdf(hi - 0.5);
+        break;
+    }
+    }
+    return pmf;
+}
+
+// SplitMix64, so derived seeds are well spread even for base seeds 0, 1, 2...
+unsigned long long mix_seed(unsigned long long base, unsigned long long index) {
+    unsigned long long z = base + 0x9e3779b97f4a7c15ULL * (index + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// The profile's rate at t, interpolated linearly and repeating every period.
+double profile_rate(const RateProfile& profile, double t) {
+    const auto& points = profile.points;
+    if (points.size() == 1) return points[0].second;
+    double offset = std::fmod(t, profile.period());
+    auto next = std::upper_bound(points.begin(), points.end(), offset,
+                                 [](double time, const auto& point) { return time < point.first; });
+    if (next == points.end()) return points.back().second;
+    auto previous = next - 1;
+    double span = next->first - previous->first;
+    return previous->second + (next->second - previous->second) * (offset - previous->first) / span;
+}
+
+// Trapezoids over one period.
+double profile_mean(const RateProfile& profile) {
+    const auto& points = profile.points;
+    if (points.size() == 1) return points[0].second;
+    double area = 0;
+    for (size_t i = 1; i < points.size(); ++i) {
+        area += (points[i].first - points[i - 1].first) * (points[i].second + points[i - 1].second) / 2;
+    }
+    return area / profile.period();
+}
+
+// The first arrival after t, by thinning: candidates come at the current
+// segment's peak rate and are kept with probability rate/peak. Bounding each
+// segment separately keeps rejections rare however tall a spike elsewhere is,
+// and an exponential gap that crosses a segment end simply restarts there.
+double next_profile_arrival(const RateProfile& profile, double t, std::mt19937_64& gen) {
+    const auto& points = profile.points;
+    const double never = std::numeric_limits<double>::infinity();
+    if (points.size() == 1) return points[0].second > 0 ? t + std::exponential_distribution<>(points[0].second)(gen) : never;
+    if (std::none_of(points.begin(), points.end(), [](const auto& point) { return point.second > 0; })) return never;
+
+    // Walk segments by index, so rounding in t can never revisit a finished one.
+    const double period = profile.period();
+    double cycle = std::floor(t / period);
+    double offset = std::min(std::max(t - cycle * period, 0.0), period);
+    size_t i = static_cast<size_t>(std::upper_bound(points.begin(), points.end(), offset,
+                                                    [](double time, const auto& point) { return time < point.first; })
+                                   - points.begin());
+    i = std::min(std::max<size_t>(i, 1), points.size() - 1) - 1;
+    std::uniform_real_distribution<> accept(0.0, 1.0);
+    while (true) {
+        const auto& from = points[i];
+        const auto& to = points[i + 1];
+        double segment_end = cycle * period + to.first;
+        double peak = std::max(from.second, to.second);
+        if (peak > 0 && segment_end > t) {
+            t += std::exponential_distribution<>(peak)(gen);
+            if (t < segment_end) {
+                double rate = from.second + (to.second - from.second) * (t - cycle * period - from.first) / (to.first - from.first);
+                if (accept(gen) * peak <= rate) return t;
+                continue;
+            }
+            t = segment_end;
+        }
+        t = std::max(t, segment_end);
+        if (++i == points.size() - 1) {
+            i = 0;
+            cycle += 1;
+        }
+    }
+}
+
+// Each role's arrivals and the run times draw from their own stream, so two
+// runs with the same seed but different instance counts see identical
+// arrivals and give the k-th party the same run time (common random numbers).
+VirtualRunResult run_virtual_simulation(const VirtualRunParams& params, unsigned long long seed) {
+    std::mt19937_64 arrival_gen[ROLE_COUNT];
+    for (int role = 0; role < ROLE_COUNT; ++role) arrival_gen[role].seed(mix_seed(seed, role));
+    std::mt19937_64 run_time_gen(mix_seed(seed, ROLE_COUNT));
+    std::discrete_distribution<int> run_time(params.duration_pmf.begin(), params.duration_pmf.end());
+    const double never = std::numeric_limits<double>::infinity();
+
+    auto arrival_after = [&](int role, double t) {
+        if (!params.profile[role].empty()) return next_profile_arrival(params.profile[role], t, arrival_gen[role]);
+        double rate = params.arrival_rate[role];
+        return rate > 0 ? t + std::exponential_distribution<>(rate)(arrival_gen[role]) : never;
+    };
+
+    double next_arrival[ROLE_COUNT];
+    for (int role = 0; role < ROLE_COUNT; ++role) next_arrival[role] = arrival_after(role, 0.0);
+
+    // Flex arrivals draw from their own streams, so pinned and flex runs with
+    // one seed see the same players at the same times.
+    std::mt19937_64 flex_gen(mix_seed(seed, ROLE_COUNT + 1));
+    std::mt19937_64 pin_gen(mix_seed(seed, ROLE_COUNT + 2));
+    std::vector<int> flex_choices;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (params.flex_roles & (1 << role)) flex_choices.push_back(role);
+    }
+    auto next_flex_gap = [&] {
+        return params.flex_rate > 0 && !flex_choices.empty() ? std::exponential_distribution<>(params.flex_rate)(flex_gen)
+                                                             : never;
+    };
+    double next_flex = next_flex_gap();
+    std::vector<double> flex_waiting;  // arrival times, FIFO
+    size_t flex_head = 0;
+    std::vector<double> flex_waits;
+
+    using Completion = std::pair<double, int>;
+    std::priority_queue<Completion, std::vector<Completion>, std::greater<Completion>> running;
+    std::priority_queue<int, std::vector<int>, std::greater<int>> free_instances;
+    for (int i = 0; i < params.instances; ++i) free_instances.push(i);
+
+    std::vector<double> waiting[ROLE_COUNT];  // arrival times, FIFO
+    size_t waiting_head[ROLE_COUNT] = {0, 0, 0};
+    std::vector<double> waits[ROLE_COUNT];
+    double wait_sum[ROLE_COUNT] = {0, 0, 0};
+    double busy_time = 0;
+    VirtualRunResult result;
+    if (params.bucket_seconds > 0) {
+        result.buckets.resize(static_cast<size_t>(std::ceil(params.horizon / params.bucket_seconds)));
+    }
+    auto bucket_at = [&](double t) -> VirtualRunResult::Bucket* {
+        if (result.buckets.empty()) return nullptr;
+        size_t index = std::min(static_cast<size_t>(t / params.bucket_seconds), result.buckets.size() - 1);
+        return &result.buckets[index];
+    };
+
+    auto queued = [&](int role) { return waiting[role].size() - waiting_head[role]; };
+    // Queue lengths are sampled as each bucket closes.
+    size_t buckets_closed = 0;
+    auto close_buckets = [&](double t) {
+        while (buckets_closed < result.buckets.size()
+               && std::min((buckets_closed + 1) * params.bucket_seconds, params.horizon) <= t) {
+            for (int r = 0; r < ROLE_COUNT; ++r) {
+                result.buckets[buckets_closed].queue_at_end[r] = static_cast<long long>(queued(r));
+            }
+            buckets_closed++;
+        }
+    };
+
+    while (true) {
+        int role = static_cast<int>(std::min_element(next_arrival, next_arrival + ROLE_COUNT) - next_arrival);
+        double completion_time = running.empty() ? never : running.top().first;
+        double now = std::min({next_arrival[role], next_flex, completion_time});
+        close_buckets(std::min(now, params.horizon));
+        if (now > params.horizon) break;
+
+        if (completion_time <= std::min(next_arrival[role], next_flex)) {
+            free_instances.push(running.top().second);
+            running.pop();
+        } else if (next_flex < next_arrival[role]) {
+            result.flex_arrived++;
+            if (params.flex_pinned) {
+                int pinned = flex_choices[std::uniform_int_distribution<size_t>(0, flex_choices.size() - 1)(pin_gen)];
+                waiting[pinned].push_back(now);
+                result.players_arrived[pinned]++;
+            } else {
+                flex_waiting.push_back(now);
+            }
+            next_flex += next_flex_gap();
+        } else {
+            waiting[role].push_back(now);
+            result.players_arrived[role]++;
+            if (auto* bucket = bucket_at(now)) bucket->arrivals[role]++;
+            next_arrival[role] = arrival_after(role, now);
+        }
+
+        while (!free_instances.empty()) {
+            // Single-role players first; flex players cover what is left.
+            size_t short_by[ROLE_COUNT] = {0, 0, 0}, flex_needed = 0;
+            bool can_form = true;
+            for (int r = 0; r < ROLE_COUNT; ++r) {
+                size_t need = static_cast<size_t>(params.party[r]);
+                short_by[r] = queued(r) < need ? need - queued(r) : 0;
+                if (short_by[r] > 0 && !(params.flex_roles & (1 << r))) can_form = false;
+                flex_needed += short_by[r];
+            }
+            if (!can_form || flex_needed > flex_waiting.size() - flex_head) break;
+
+            for (int r = 0; r < ROLE_COUNT; ++r) {
+                for (size_t k = 0; k < short_by[r]; ++k) {
+                    flex_waits.push_back(now - flex_waiting[flex_head++]);
+                    result.flex_matched[r]++;
+                }
+                for (size_t k = short_by[r]; k < static_cast<size_t>(params.party[r]); ++k) {
+                    double wait = now - waiting[r][waiting_head[r]++];
+                    waits[r].push_back(wait);
+                    wait_sum[r] += wait;
+                    result.players_matched[r]++;
+                    if (auto* bucket = bucket_at(now)) {
+                        bucket->matched[r]++;
+                        bucket->wait_sum[r] += wait;
+                        bucket->max_wait = std::max(bucket->max_wait, wait);
+                    }
+                }
+                // Compact the FIFO once its consumed prefix dominates.
+                if (waiting_head[r] > 4096 && waiting_head[r] * 2 > waiting[r].size()) {
+                    waiting[r].erase(waiting[r].begin(), waiting[r].begin() + waiting_head[r]);
+                    waiting_head[r] = 0;
+                }
+            }
+            int duration = params.min_time + run_time(run_time_gen);
+            busy_time += std::min<double>(duration, params.horizon - now);
+            if (auto* bucket = bucket_at(now)) bucket->parties_formed++;
+            // Spread the run's busy time over the buckets it spans.
+            for (double from = now, end = std::min<double>(now + duration, params.horizon);
+                 !result.buckets.empty() && from < end;) {
+                double bucket_end = (std::floor(from / params.bucket_seconds) + 1) * params.bucket_seconds;
+                double to = std::min(end, bucket_end);
+                bucket_at(from)->busy_seconds += to - from;
+                from = to;
+            }
+            running.push({now + duration, free_instances.top()});
+            free_instances.pop();
+            result.parties_formed++;
+        }
+    }
+
+    close_buckets(params.horizon);
+    // Players still queued at the horizon count with their wait so far, so an
+    // exploding queue shows up in the percentiles instead of vanishing.
+    for (size_t i = flex_head; i < flex_waiting.size(); ++i) flex_waits.push_back(params.horizon - flex_waiting[i]);
+    if (!flex_waits.empty()) {
+        result.flex_mean_wait = std::accumulate(flex_waits.begin(), flex_waits.end(), 0.0) / flex_waits.size();
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        for (size_t i = waiting_head[role]; i < waiting[role].size(); ++i) {
+            double wait = params.horizon - waiting[role][i];
+            waits[role].push_back(wait);
+            wait_sum[role] += wait;
+        }
+        if (waits[role].empty()) continue;
+        result.mean_wait[role] = wait_sum[role] / waits[role].size();
+        auto p99 = waits[role].begin() + static_cast<std::ptrdiff_t>(0.99 * (waits[role].size() - 1));
+        std::nth_element(waits[role].begin(), p99, waits[role].end());
+        result.p99_wait[role] = *p99;
+    }
+    if (params.instances > 0 && params.horizon > 0) result.utilization = busy_time / (params.instances * params.horizon);
+    return result;
+}
+
+// Fills params from the config, prompting for values the analytic modes need
+// but the config left unset. Rejects workloads that can never form a party.
+bool build_virtual_params(const SimulationConfig& config, bool need_instances, VirtualRunParams& params) {
+    int lo = 0, hi = 0;
+    if (need_instances) {
+        if (config.instances) params.instances = *config.instances;
+        else if (!prompt_value("Enter max number of concurrent instances (n): ", 1, max_instances, params.instances)) return false;
+    }
+    if (config.min_time) lo = *config.min_time;
+    else if (!prompt_value("Enter minimum dungeon time in seconds (t1): ", 0, max_run_seconds, lo)) return false;
+    if (config.max_time) hi = *config.max_time;
+    else if (!prompt_value("Enter maximum dungeon time in seconds (t2): ", 0, max_run_seconds, hi)) return false;
+    if (lo > hi) std::swap(lo, hi);
+
+    std::copy(std::begin(config.party), std::end(config.party), params.party);
+    std::copy(std::begin(config.arrival_rate), std::end(config.arrival_rate), params.arrival_rate);
+    // A profiled role runs on its curve; the analytic modes see its mean rate.
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (config.arrival_profile[role].empty()) continue;
+        params.profile[role] = config.arrival_profile[role];
+        params.arrival_rate[role] = profile_mean(config.arrival_profile[role]);
+    }
+    params.min_time = lo;
+    params.duration_pmf = duration_pmf(config.distribution, lo, hi);
+
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (config.party[role] > 0 && params.arrival_rate[role] <= 0) {
+            std::cerr << "Analysis needs a positive arrival rate for every role in the party (--arrival-rate t,h,d"
+                         " or a --profile-<role> curve).\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the role with the lowest party-forming rate. limiting[] marks every
+// role within rounding of that rate; the rest accumulate a surplus.
+int find_bottleneck(const VirtualRunParams& params, bool (&limiting)[ROLE_COUNT]) {
+    double party_rate = std::numeric_limits<double>::infinity();
+    int bottleneck = -1;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (params.party[role] == 0) continue;
+        double rate = params.arrival_rate[role] / params.party[role];
+        if (rate < party_rate) {
+            party_rate = rate;
+            bottleneck = role;
+        }
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        double surplus = params.arrival_rate[role] - party_rate * params.party[role];
+        limiting[role] = params.party[role] > 0 && surplus <= 1e-9 * params.arrival_rate[role];
+    }
+    return bottleneck;
+}
+
+namespace {
+
+// Erlang C via the Erlang B recursion, which stays stable for large c.
+double erlang_c(int servers, double offered_load) {
+    double erlang_b = 1.0;
+    for (int k = 1; k <= servers; ++k) erlang_b = offered_load * erlang_b / (k + offered_load * erlang_b);
+    double rho = offered_load / servers;
+    return erlang_b / (1.0 - rho + rho * erlang_b);
+}
+
+} // namespace
+
+// Parties are treated as M/G/c customers arriving at the rate of the scarcest
+// role, with the Allen-Cunneen correction for the run-time variability.
+int run_capacity_analysis(const SimulationConfig& config) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    auto started = std::chrono::steady_clock::now();
+
+    VirtualRunParams params;
+    if (!build_virtual_params(config, true, params)) return 1;
+    int n = params.instances;
+    int lo = params.min_time;
+    int hi = lo + static_cast<int>(params.duration_pmf.size()) - 1;
+    const std::vector<double>& pmf = params.duration_pmf;
+
+    bool limiting[ROLE_COUNT];
+    int bottleneck = find_bottleneck(params, limiting);
+    double party_rate = params.arrival_rate[bottleneck] / config.party[bottleneck];
+
+    double mean = 0, second_moment = 0;
+    for (size_t j = 0; j < pmf.size(); ++j) {
+        double t = lo + static_cast<double>(j);
+        mean += pmf[j] * t;
+        second_moment += pmf[j] * t * t;
+    }
+    double scv = mean > 0 ? (second_moment - mean * mean) / (mean * mean) : 0;
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "--- Capacity Estimate (M/G/c approximation) ---\n"
+              << "Arrival rates: " << params.arrival_rate[ROLE_TANK] << " T/s, " << params.arrival_rate[ROLE_HEALER]
+              << " H/s, " << params.arrival_rate[ROLE_DPS] << " D/s | Party template " << config.party[ROLE_TANK] << "T/"
+              << config.party[ROLE_HEALER] << "H/" << config.party[ROLE_DPS] << "D\n"
+              << "Party formation rate: " << party_rate << " parties/s (bottleneck role: " << role_names[bottleneck] << ")\n"
+              << "Run time: mean " << mean << "s, SCV " << scv << " (" << lo << "-" << hi << "s)\n";
+
+    std::string tied_roles;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (config.party[role] == 0) continue;
+        if (!limiting[role]) {
+            std::cout << "Surplus " << role_names[role] << ": +" << params.arrival_rate[role] - party_rate * config.party[role]
+                      << " players/s are never matched\n";
+        } else if (role != bottleneck) {
+            tied_roles += std::string(tied_roles.empty() ? "" : ", ") + role_names[role];
+        }
+    }
+    // With two balanced Poisson streams the backlog between them is a
+    // zero-drift random walk, which no closed-form steady state describes.
+    if (!tied_roles.empty()) {
+        std::cout << "Warning: arrivals of " << tied_roles << " match the bottleneck rate exactly; the matching backlog is a "
+                  << "zero-drift random walk and those waits grow with run length (use --cross-check).\n";
+    }
+
+    double offered_load = party_rate * mean;
+    double utilization = n > 0 ? offered_load / n : std::numeric_limits<double>::infinity();
+    std::cout << "Instances: " << n << " | Offered load " << offered_load << " | Utilization "
+              << std::setprecision(1) << 100.0 * std::min(utilization, 1.0) << "%\n" << std::setprecision(3);
+
+    double fill_wait = config.party[bottleneck] > 1
+        ? (config.party[bottleneck] - 1) / (2.0 * params.arrival_rate[bottleneck]) : 0.0;
+    if (utilization >= 1.0) {
+        std::cout << "Unstable: parties arrive " << party_rate - (mean > 0 ? n / mean : 0)
+                  << "/s faster than instances free; waits grow without bound.\n";
+    } else {
+        double p_wait = mean > 0 ? erlang_c(n, offered_load) : 0;
+        double drain_rate = mean > 0 ? (n / mean - party_rate) * 2.0 / (1.0 + scv) : 0;
+        double queue_wait = drain_rate > 0 ? p_wait / drain_rate : 0;
+        double p99 = (drain_rate > 0 && p_wait > 0.01) ? std::log(p_wait / 0.01) / drain_rate : 0;
+        std::cout << "Instance wait per party: P(wait) " << p_wait << ", mean " << queue_wait << "s, p99 " << p99 << "s\n"
+                  << "Bottleneck " << role_names[bottleneck] << " wait: " << fill_wait << "s to fill party + "
+                  << queue_wait << "s for an instance = " << fill_wait + queue_wait << "s\n";
+    }
+
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Computed in " << elapsed_ms << " ms\n";
+
+    if (config.cross_check_seconds > 0) {
+        params.horizon = config.cross_check_seconds;
+        unsigned long long seed = config.seed ? *config.seed : std::random_device{}();
+
+        started = std::chrono::steady_clock::now();
+        VirtualRunResult result = run_virtual_simulation(params, seed);
+        elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+        std::cout << "--- Virtual-Time Cross-Check (" << params.horizon << "s, seed " << seed << ") ---\n"
+                  << "Parties formed: " << result.parties_formed << " (" << result.parties_formed / params.horizon
+                  << "/s) | Utilization " << std::setprecision(1) << 100.0 * result.utilization << "%\n"
+                  << std::setprecision(3)
+                  << "Mean wait: " << result.mean_wait[ROLE_TANK] << "s T, " << result.mean_wait[ROLE_HEALER] << "s H, "
+                  << result.mean_wait[ROLE_DPS] << "s D | Bottleneck " << role_names[bottleneck] << " mean "
+                  << result.mean_wait[bottleneck] << "s, p99 " << result.p99_wait[bottleneck] << "s\n"
+                  << "Simulated in " << elapsed_ms << " ms\n";
+    }
+    return 0;
+}
+
+// Searches the smallest instance count whose worst limiting-role p99 wait
+// meets the target. Each round simulates one candidate per thread, spread
+// evenly over the open interval, and all candidates share the same seed
+// (common random numbers) so their comparison is not swamped by noise.
+int run_instance_search(const SimulationConfig& config) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    auto started = std::chrono::steady_clock::now();
+
+    if (config.p99_target <= 0) {
+        std::cerr << "--find-min-instances needs a positive --p99-target in seconds.\n";
+        return 1;
+    }
+    VirtualRunParams params;
+    if (!build_virtual_params(config, false, params)) return 1;
+    params.horizon = config.search_horizon;
+
+    bool limiting[ROLE_COUNT];
+    int bottleneck = find_bottleneck(params, limiting);
+    double party_rate = params.arrival_rate[bottleneck] / params.party[bottleneck];
+    double mean_run = 0;
+    for (size_t j = 0; j < params.duration_pmf.size(); ++j) mean_run += params.duration_pmf[j] * (params.min_time + j);
+
+    unsigned long long seed = config.seed ? *config.seed : std::random_device{}();
+    int threads = config.search_threads > 0 ? config.search_threads
+                                            : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    struct Evaluation {
+        int instances;
+        double p99;
+        int worst_role;
+        double utilization;
+    };
+    std::vector<Evaluation> evaluated;
+
+    auto evaluate = [&](std::vector<int> candidates) {
+        std::vector<Evaluation> results(candidates.size());
+        std::vector<std::thread> search_threads;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            search_threads.emplace_back([&, i] {
+                VirtualRunParams candidate = params;
+                candidate.instances = candidates[i];
+                VirtualRunResult run = run_virtual_simulation(candidate, seed);
+                Evaluation& e = results[i];
+                e = {candidates[i], 0, bottleneck, run.utilization};
+                for (int role = 0; role < ROLE_COUNT; ++role) {
+                    if (limiting[role] && run.p99_wait[role] > e.p99) {
+                        e.p99 = run.p99_wait[role];
+                        e.worst_role = role;
+                    }
+                }
+            });
+        }
+        for (auto& thread : search_threads) thread.join();
+        for (const auto& e : results) {
+            std::cout << std::fixed << std::setprecision(2) << "  n=" << e.instances << ": p99 " << e.p99 << "s ("
+                      << role_names[e.worst_role] << "), utilization " << std::setprecision(1) << 100.0 * e.utilization
+                      << "% " << (e.p99 <= config.p99_target ? "meets" : "misses") << " target\n";
+        }
+        evaluated.insert(evaluated.end(), results.begin(), results.end());
+        return results;
+    };
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "--- Minimum Instance Search (p99 target " << config.p99_target << "s, horizon " << params.horizon
+              << "s, seed " << seed << ", " << threads << " thread(s)) ---\n";
+
+    // Below the offered load the queue is unstable, so start just above it.
+    int low = std::clamp(static_cast<int>(std::floor(party_rate * mean_run)), 0, max_instances - 1);  // known to miss
+    int high = -1;                                                                                     // known to meet
+
+    // Grow geometrically until some candidate meets the target. If doubling
+    // the step stops improving p99, the wait is party filling, not instances.
+    double last_miss = std::numeric_limits<double>::infinity();
+    bool plateau = false;
+    for (long long step = 1; high < 0 && !plateau && low < max_instances; ) {
+        std::vector<int> candidates;
+        for (int i = 0; i < threads && low + step <= max_instances; ++i, step *= 2) {
+            candidates.push_back(static_cast<int>(low + step));
+        }
+        if (candidates.empty()) candidates.push_back(max_instances);
+        for (const auto& e : evaluate(candidates)) {
+            if (e.p99 <= config.p99_target) {
+                high = e.instances;
+                break;
+            }
+            plateau = low > 0 && e.p99 >= 0.99 * last_miss;
+            last_miss = e.p99;
+            low = e.instances;
+            if (plateau) break;
+        }
+    }
+
+    if (high < 0) {
+        std::cout << std::setprecision(2) << "No instance count meets the target: p99 levels off at " << last_miss
+                  << "s, which is party-filling time rather than instance wait. Raise the target or rebalance arrivals.\n";
+        return 2;
+    }
+
+    // Parallel k-ary search: split (low, high) into threads + 1 slices per round.
+    while (high - low > 1) {
+        std::vector<int> candidates;
+        for (int i = 1; i <= threads; ++i) {
+            int candidate = low + static_cast<int>((static_cast<long long>(high - low) * i) / (threads + 1));
+            if (candidate > low && candidate < high && (candidates.empty() || candidate != candidates.back())) {
+                candidates.push_back(candidate);
+            }
+        }
+        if (candidates.empty()) candidates.push_back(low + (high - low) / 2);
+        for (const auto& e : evaluate(candidates)) {
+            if (e.p99 <= config.p99_target) {
+                high = std::min(high, e.instances);
+            } else if (e.instances < high) {
+                low = std::max(low, e.instances);
+            }
+        }
+    }
+
+    const Evaluation& best = *std::find_if(evaluated.begin(), evaluated.end(),
+                                           [high](const Evaluation& e) { return e.instances == high; });
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cout << std::setprecision(2) << "Minimum instances: " << high << " (p99 " << best.p99 << "s "
+              << role_names[best.worst_role] << ", utilization " << std::setprecision(1) << 100.0 * best.utilization
+              << "%) after " << evaluated.size() << " simulations in " << std::setprecision(0) << elapsed_ms << " ms\n";
+    return 0;
+}
+
+namespace {
+
+// Regularized incomplete beta I_x(a, b), by Lentz's continued fraction.
+double incomplete_beta(double x, double a, double b) {
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    if (x > (a + 1) / (a + b + 2)) return 1 - incomplete_beta(1 - x, b, a);
+    const double tiny = 1e-300;
+    double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log1p(-x));
+    double f = 1, c = 1, d = 0;
+    for (int i = 0; i <= 400; ++i) {
+        int m = i / 2;
+        double numerator = i == 0       ? 1
+                           : i % 2 == 0 ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+                                        : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+        d = 1 + numerator * d;
+        d = 1 / (std::fabs(d) < tiny ? tiny : d);
+        c = 1 + numerator / c;
+        if (std::fabs(c) < tiny) c = tiny;
+        f *= c * d;
+        if (std::fabs(1 - c * d) < 1e-15) break;
+    }
+    return front * (f - 1) / a;
+}
+
+// Exact Student-t quantile for p > 0.5, by bisection on the CDF, so small
+// replication counts (down to one degree of freedom) get full-width intervals.
+double t_quantile(double p, int dof) {
+    double v = dof;
+    auto cdf = [v](double t) { return 1 - 0.5 * incomplete_beta(v / (v + t * t), v / 2, 0.5); };
+    double lo = 0, hi = 1;
+    while (cdf(hi) < p && hi < 1e12) hi *= 2;
+    for (int i = 0; i < 200; ++i) {
+        double mid = (lo + hi) / 2;
+        (cdf(mid) < p ? lo : hi) = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+struct Interval {
+    double mean = 0;
+    double variance = 0;
+    double half_width = 0;
+};
+
+Interval confidence_interval(const std::vector<double>& samples, double level) {
+    Interval interval;
+    size_t r = samples.size();
+    for (double x : samples) interval.mean += x;
+    interval.mean /= r;
+    for (double x : samples) interval.variance += (x - interval.mean) * (x - interval.mean);
+    interval.variance /= r - 1;
+    interval.half_width = t_quantile(0.5 + level / 2, static_cast<int>(r) - 1) * std::sqrt(interval.variance / r);
+    return interval;
+}
+
+} // namespace
+
+// Runs R independent virtual-time replications in parallel and reports
+// confidence intervals. With --compare-instances, replication i of both
+// configurations uses the same seed (common random numbers), so the paired
+// difference has far less variance than two independent estimates.
+int run_monte_carlo(const SimulationConfig& config) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    enum Metric { THROUGHPUT, UTILIZATION, MEAN_WAIT, P99_WAIT, METRIC_COUNT };
+    static const char* const metric_names[METRIC_COUNT] = {"Throughput", "Utilization", "Mean wait", "p99 wait"};
+    static const char* const metric_units[METRIC_COUNT] = {" parties/s", "%", "s", "s"};
+    auto started = std::chrono::steady_clock::now();
+
+    VirtualRunParams params;
+    if (!build_virtual_params(config, true, params)) return 1;
+    params.horizon = config.search_horizon;
+
+    bool limiting[ROLE_COUNT];
+    int bottleneck = find_bottleneck(params, limiting);
+    unsigned long long base_seed = config.seed ? *config.seed : std::random_device{}();
+    int threads = config.search_threads > 0 ? config.search_threads
+                                            : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    std::vector<int> configurations = {params.instances};
+    if (config.compare_instances) configurations.push_back(*config.compare_instances);
+    const int r = config.replications;
+
+    // samples[configuration][metric][replication]
+    std::vector<std::vector<std::vector<double>>> samples(
+        configurations.size(), std::vector<std::vector<double>>(METRIC_COUNT, std::vector<double>(r)));
+
+    std::atomic<int> next_job(0);
+    const int jobs = r * static_cast<int>(configurations.size());
+    std::vector<std::thread> replication_threads;
+    for (int t = 0; t < std::min(threads, jobs); ++t) {
+        replication_threads.emplace_back([&] {
+            for (int job; (job = next_job++) < jobs; ) {
+                int c = job % static_cast<int>(configurations.size());
+                int replication = job / static_cast<int>(configurations.size());
+                VirtualRunParams run_params = params;
+                run_params.instances = configurations[c];
+                VirtualRunResult run = run_virtual_simulation(run_params, mix_seed(base_seed, replication));
+
+                double p99 = 0;
+                for (int role = 0; role < ROLE_COUNT; ++role) {
+                    if (limiting[role]) p99 = std::max(p99, run.p99_wait[role]);
+                }
+                samples[c][THROUGHPUT][replication] = run.parties_formed / params.horizon;
+                samples[c][UTILIZATION][replication] = 100.0 * run.utilization;
+                samples[c][MEAN_WAIT][replication] = run.mean_wait[bottleneck];
+                samples[c][P99_WAIT][replication] = p99;
+            }
+        });
+    }
+    for (auto& thread : replication_threads) thread.join();
+
+    std::cout << std::fixed << std::setprecision(0)
+              << "--- Monte Carlo (" << r << " replications, horizon " << params.horizon << "s, "
+              << std::setprecision(1) << 100.0 * config.confidence << "% CI, base seed " << base_seed << ") ---\n";
+    for (size_t c = 0; c < configurations.size(); ++c) {
+        std::cout << "n=" << configurations[c] << " (waits for bottleneck role " << role_names[bottleneck] << "):\n";
+        for (int m = 0; m < METRIC_COUNT; ++m) {
+            Interval interval = confidence_interval(samples[c][m], config.confidence);
+            std::cout << std::setprecision(4) << "  " << std::left << std::setw(12) << metric_names[m] << std::right
+                      << interval.mean << " +/- " << interval.half_width << metric_units[m] << "\n";
+        }
+    }
+
+    if (configurations.size() == 2) {
+        std::cout << "n=" << configurations[1] << " minus n=" << configurations[0] << " (common random numbers):\n";
+        for (int m = 0; m < METRIC_COUNT; ++m) {
+            std::vector<double> difference(r);
+            for (int i = 0; i < r; ++i) difference[i] = samples[1][m][i] - samples[0][m][i];
+            Interval paired = confidence_interval(difference, config.confidence);
+            double independent = confidence_interval(samples[0][m], config.confidence).variance
+                                 + confidence_interval(samples[1][m], config.confidence).variance;
+            std::cout << std::setprecision(4) << "  " << std::left << std::setw(12) << metric_names[m] << std::right
+                      << paired.mean << " +/- " << paired.half_width << metric_units[m];
+            if (paired.variance > 0) {
+                std::cout << std::setprecision(1) << " (variance reduction x" << independent / paired.variance
+                          << " vs independent runs)";
+            }
+            std::cout << "\n";
+        }
+    }
+
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    std::cout << std::setprecision(0) << jobs << " simulations on " << std::min(threads, jobs) << " thread(s) in "
+              << elapsed_ms << " ms\n";
+    return 0;
+}
+
+// Runs the same seeded arrivals twice: once with flex players pinned to one
+// of their roles at random (what they do without flex queueing), once with
+// flex players assigned wherever a party is short.
+int run_flex_comparison(const SimulationConfig& config) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    VirtualRunParams params;
+    if (!build_virtual_params(config, true, params)) return 1;
+    if (config.flex_rate <= 0) {
+        std::cerr << "--flex-compare needs a positive --flex-rate.\n";
+        return 1;
+    }
+    params.horizon = config.search_horizon;
+    params.flex_rate = config.flex_rate;
+    params.flex_roles = config.flex_roles;
+    unsigned long long seed = config.seed ? *config.seed : std::random_device{}();
+
+    VirtualRunResult runs[2];
+    std::thread pinned_run([&] {
+        VirtualRunParams pinned = params;
+        pinned.flex_pinned = true;
+        runs[0] = run_virtual_simulation(pinned, seed);
+    });
+    runs[1] = run_virtual_simulation(params, seed);
+    pinned_run.join();
+
+    std::string roles;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        if (!(params.flex_roles & (1 << role))) continue;
+        if (!roles.empty()) roles += "/";
+        roles += role_names[role];
+    }
+    std::cout << std::fixed << std::setprecision(0) << "--- Flex roles (n=" << params.instances << ", horizon "
+              << params.horizon << "s, seed " << seed << ", " << std::setprecision(3) << params.flex_rate
+              << " flex " << roles << " players/s) ---\n";
+    static const char* const labels[2] = {"Single-role", "Flex"};
+    for (int i = 0; i < 2; ++i) {
+        const VirtualRunResult& run = runs[i];
+        std::cout << std::setprecision(1) << std::left << std::setw(12) << labels[i] << std::right
+                  << run.parties_formed * 3600.0 / params.horizon << " parties/h, utilization "
+                  << 100.0 * run.utilization << "%\n  waits mean/p99:";
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            std::cout << " " << role_names[role] << " " << run.mean_wait[role] << "/" << run.p99_wait[role] << "s";
+        }
+        if (i == 1) {
+            std::cout << ", flex mean " << run.flex_mean_wait << "s\n  flex players matched as "
+                      << run.flex_matched[ROLE_TANK] << "T/" << run.flex_matched[ROLE_HEALER] << "H/"
+                      << run.flex_matched[ROLE_DPS] << "D of " << run.flex_arrived;
+        }
+        std::cout << "\n";
+    }
+    if (runs[0].parties_formed > 0) {
+        std::cout << std::setprecision(1) << "Throughput gain from flex queueing: "
+                  << 100.0 * (runs[1].parties_formed - runs[0].parties_formed) / runs[0].parties_formed << "%\n";
+    }
+    return 0;
+}
+
+// Runs the profiled workload for --horizon seconds of virtual time and
+// prints one row per bucket, so the hours where a fixed n falls behind show
+// up as a growing queue and wait.
+int run_profile_report(const SimulationConfig& config) {
+    static const char* const role_names[ROLE_COUNT] = {"tank", "healer", "dps"};
+    VirtualRunParams params;
+    if (!build_virtual_params(config, true, params)) return 1;
+    params.horizon = config.search_horizon;
+    params.bucket_seconds = config.profile_bucket;
+    unsigned long long seed = config.seed ? *config.seed : std::random_device{}();
+    VirtualRunResult run = run_virtual_simulation(params, seed);
+
+    auto clock = [](double seconds) {
+        long long total = static_cast<long long>(seconds);
+        std::stringstream ss;
+        ss << total / 3600 << ":" << std::setw(2) << std::setfill('0') << total / 60 % 60;
+        if (total % 60) ss << ":" << std::setw(2) << total % 60;
+        return ss.str();
+    };
+    std::cout << std::fixed << std::setprecision(0) << "--- Arrival profile (n=" << params.instances << ", horizon "
+              << params.horizon << "s, " << params.bucket_seconds << "s buckets, seed " << seed << ") ---\n"
+              << std::left << std::setw(10) << "Start" << std::right << std::setw(18) << "Arrivals T/H/D"
+              << std::setw(9) << "Parties" << std::setw(8) << "Util" << std::setw(26) << "Mean wait T/H/D (s)"
+              << std::setw(11) << "Max wait" << std::setw(20) << "Queue at end T/H/D" << "\n";
+    double worst_wait = 0, worst_start = 0;
+    for (size_t i = 0; i < run.buckets.size(); ++i) {
+        const VirtualRunResult::Bucket& bucket = run.buckets[i];
+        double start = i * params.bucket_seconds;
+        double width = std::min(params.bucket_seconds, params.horizon - start);
+        std::stringstream arrivals, waits, queues;
+        waits << std::fixed << std::setprecision(1);
+        for (int role = 0; role < ROLE_COUNT; ++role) {
+            const char* separator = role ? "/" : "";
+            arrivals << separator << bucket.arrivals[role];
+            waits << separator << (bucket.matched[role] ? bucket.wait_sum[role] / bucket.matched[role] : 0.0);
+            queues << separator << bucket.queue_at_end[role];
+        }
+        std::cout << std::left << std::setw(10) << clock(start) << std::right << std::setw(18) << arrivals.str()
+                  << std::setw(9) << bucket.parties_formed << std::setw(7) << std::setprecision(1)
+                  << (width > 0 && params.instances > 0 ? 100.0 * bucket.busy_seconds / (width * params.instances) : 0.0)
+                  << "%" << std::setw(26) << waits.str() << std::setw(10) << bucket.max_wait << "s" << std::setw(20)
+                  << queues.str() << "\n";
+        if (bucket.max_wait > worst_wait) {
+            worst_wait = bucket.max_wait;
+            worst_start = start;
+        }
+    }
+    std::cout << std::setprecision(1) << "Overall " << run.parties_formed * 3600.0 / params.horizon
+              << " parties/h, utilization " << 100.0 * run.utilization << "%, mean wait";
+    for (int role = 0; role < ROLE_COUNT; ++role) std::cout << " " << role_names[role] << " " << run.mean_wait[role] << "s";
+    std::cout << "\n";
+    if (worst_wait > 0) std::cout << "Longest wait " << worst_wait << "s, in the bucket starting at " << clock(worst_start) << "\n";
+    return 0;
+}